@@ -7,170 +7,943 @@
 */
 
 #include "cache.h"
+#include "probes.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
 #include <errno.h>
 #include <glib.h>
 #include <pthread.h>
 
+#define REFRESH_STAT (1 << 0)
+#define REFRESH_DIR  (1 << 1)
+
+/* Entries are grouped by the directory holding them, and directories are
+   spread over CACHE_SHARDS independent tables selected by the hash of the
+   directory path, so that lookups in unrelated directories don't contend on
+   a single lock. Must be a power of two. */
+#define CACHE_SHARDS 64
+
+/* Entries whose attributes are cached together while a directory is being
+   listed */
+#define CACHE_ATTR_BATCH 256
+
+/* Seconds since cache.epoch. 32 bits are plenty and keep the entries small.
+   0 means never valid. */
+typedef uint32_t cache_time_t;
+
+struct cache_shard {
+    pthread_rwlock_t lock;
+    GHashTable *dirs;
+    GPtrArray *timers;   /* binary min-heap of struct cache_timer */
+    unsigned long hits;
+    unsigned long misses;
+};
+
+/* Keep each shard on its own cache lines */
+union cache_shard_slot {
+    struct cache_shard shard;
+    char pad[128];
+};
+
 struct cache {
     int on;
     unsigned stat_timeout;
     unsigned dir_timeout;
     unsigned link_timeout;
+    unsigned max_stale;
+    unsigned max_entries;
+    unsigned long long max_bytes;
     struct fuse_cache_operations *next_oper;
-    GHashTable *table;
-    pthread_mutex_t lock;
-    time_t last_cleaned;
+    time_t epoch;
+    union cache_shard_slot shards[CACHE_SHARDS];
+    /* CLOCK replacement over all entries. Entries are added and removed with
+       their shard write-locked and then clock_lock, eviction takes clock_lock
+       and only try-locks the shard. */
+    pthread_mutex_t clock_lock;
+    GPtrArray *clock;
+    unsigned clock_hand;
+    unsigned long nentries;
+    unsigned long long bytes;
+    unsigned long long evictions;
+    pthread_mutex_t refresh_lock;
+    pthread_cond_t refresh_cond;
+    GQueue *refresh_queue;
+    pthread_t refresh_thread;
+    int refresh_started;
+    int refresh_stop;
 };
 
 static struct cache cache;
 
+#define TIMER_IDLE UINT32_MAX
+
+/* Expired entries are reclaimed a few at a time in expiry order from a heap
+   per shard instead of sweeping the whole cache. A timer may fire early,
+   in which case its owner is simply rescheduled. */
+struct cache_timer {
+    cache_time_t expires;
+    uint32_t idx;           /* position in the heap or TIMER_IDLE */
+    unsigned char is_dir;
+};
+
+/* A cached directory. Its path is stored only once here rather than in front
+   of the name of every entry below it. The listing is the set of entries
+   flagged NODE_LISTED. */
+struct cache_dir {
+    char *path;
+    GHashTable *entries;
+    struct cache_timer timer;
+    cache_time_t dir_valid;
+    unsigned char refreshing;
+};
+
+#define NODE_NOT_FOUND (1 << 0)
+#define NODE_LISTED    (1 << 1)
+
+/* A cached path. Only the parts of struct stat that a directory listing can
+   fill in are kept: atime and ctime are reported equal to mtime, st_blocks
+   is derived from the size. The entries table of the parent uses the name as
+   both key and value, see node_of(). */
 struct node {
-    struct stat stat;
-    int not_found;
-    time_t stat_valid;
-    char **dir;
-    time_t dir_valid;
     char *link;
-    time_t link_valid;
-    time_t valid;
+    struct cache_dir *dir;
+    uint64_t size;
+    int64_t mtime;
+    uint32_t mode;
+    uint32_t nlink;
+    uint32_t blksize;
+    cache_time_t stat_valid;
+    cache_time_t link_valid;
+    uint32_t clock_idx;
+    struct cache_timer timer;
+    unsigned char flags;
+    unsigned char refreshing;
+    unsigned char referenced;   /* set on every hit, cleared by the clock */
+    char name[];
+};
+
+#define node_of(name_) \
+    ((struct node *) ((char *) (name_) - offsetof(struct node, name)))
+
+/* Marks node as used for the clock. Hits only read the flag once it is set,
+   so that lookups in the same directory don't keep writing to each other's
+   cache lines. The clock clears it without the shard lock, hence the
+   atomics. */
+#define node_touch(node_) \
+    do { \
+        if (!__atomic_load_n(&(node_)->referenced, __ATOMIC_RELAXED)) \
+            __atomic_store_n(&(node_)->referenced, 1, __ATOMIC_RELAXED); \
+    } while (0)
+
+#define timer_owner(timer_, type_) \
+    ((type_ *) ((char *) (timer_) - offsetof(type_, timer)))
+
+/* A path split into its directory and its name. "/" is the entry "" of
+   itself. */
+struct cache_path {
+    char *dir;
+    const char *name;
+    char buf[256];
+};
+
+struct refresh_req {
+    char *path;
+    int what;
 };
 
 struct fuse_cache_dirhandle {
     const char *path;
     fuse_dirh_t h;
     fuse_dirfil_t filler;
+#if FUSE_VERSION >= 23
+    void *buf;
+    fuse_fill_dir_t fill_dir;
+#endif
     GPtrArray *dir;
+    struct stat *batch;     /* attributes of the entries not yet cached */
+    guint batch_start;      /* index in dir of the first of those */
+    size_t bytes;           /* what caching the listing would take */
+    int oversized;          /* too big to be cached at all */
 };
 
-static void free_node(gpointer node_)
+static void free_node(gpointer name)
 {
-    struct node *node = (struct node *) node_;
-    g_strfreev(node->dir);
+    struct node *node = node_of(name);
     g_free(node->link);
     g_free(node);
 }
 
-static int cache_clean_entry(void *key_, struct node *node, time_t *now)
+static void free_dir(gpointer dir_)
 {
-    (void) key_;
-    if (*now > node->valid)
-        return TRUE;
-    else
-        return FALSE;
+    struct cache_dir *dir = (struct cache_dir *) dir_;
+    g_hash_table_destroy(dir->entries);
+    g_free(dir->path);
+    g_free(dir);
 }
 
-static void cache_clean(void)
+static cache_time_t cache_now(void)
 {
-    time_t now = time(NULL);
-    if (now > cache.last_cleaned + MIN_CACHE_CLEAN_INTERVAL &&
-         (g_hash_table_size(cache.table) > MAX_CACHE_SIZE ||
-          now > cache.last_cleaned + CACHE_CLEAN_INTERVAL)) {
-        g_hash_table_foreach_remove(cache.table,
-                                    (GHRFunc) cache_clean_entry, &now);
-        cache.last_cleaned = now;
+    return (cache_time_t) (time(NULL) - cache.epoch);
+}
+
+static void cache_split(struct cache_path *cp, const char *path)
+{
+    const char *s = strrchr(path, '/');
+    size_t len;
+
+    if (s == NULL) {
+        cp->name = path;
+        len = 0;
+    } else {
+        cp->name = s + 1;
+        len = s - path;
+    }
+    if (len == 0) {
+        path = "/";
+        len = 1;
+    }
+    if (len < sizeof(cp->buf)) {
+        memcpy(cp->buf, path, len);
+        cp->buf[len] = '\0';
+        cp->dir = cp->buf;
+    } else {
+        cp->dir = g_strndup(path, len);
     }
 }
 
-static struct node *cache_lookup(const char *path)
+static void cache_path_free(struct cache_path *cp)
+{
+    if (cp->dir != cp->buf)
+        g_free(cp->dir);
+}
+
+static struct cache_shard *cache_shard(const char *dir)
+{
+    return &cache.shards[g_str_hash(dir) & (CACHE_SHARDS - 1)].shard;
+}
+
+static size_t node_bytes(const struct node *node)
+{
+    return offsetof(struct node, name) + strlen(node->name) + 1 +
+           (node->link ? strlen(node->link) + 1 : 0);
+}
+
+static size_t dir_bytes(const struct cache_dir *dir)
+{
+    return sizeof(struct cache_dir) + strlen(dir->path) + 1;
+}
+
+static void cache_charge(long long bytes)
+{
+    pthread_mutex_lock(&cache.clock_lock);
+    cache.bytes += bytes;
+    pthread_mutex_unlock(&cache.clock_lock);
+}
+
+static void cache_link_node(struct node *node)
+{
+    pthread_mutex_lock(&cache.clock_lock);
+    node->clock_idx = cache.clock->len;
+    __atomic_store_n(&node->referenced, 1, __ATOMIC_RELAXED);
+    g_ptr_array_add(cache.clock, node);
+    cache.nentries++;
+    cache.bytes += node_bytes(node);
+    pthread_mutex_unlock(&cache.clock_lock);
+}
+
+/* Called with cache.clock_lock held */
+static void cache_unlink_node_locked(struct node *node)
 {
-    return (struct node *) g_hash_table_lookup(cache.table, path);
+    guint idx = node->clock_idx;
+    g_ptr_array_remove_index_fast(cache.clock, idx);
+    if (idx < cache.clock->len)
+        ((struct node *) g_ptr_array_index(cache.clock, idx))->clock_idx = idx;
+    cache.nentries--;
+    cache.bytes -= node_bytes(node);
 }
 
-static void cache_purge(const char *path)
+/* Called with cache.clock_lock held */
+static int cache_over_budget(void)
 {
-    g_hash_table_remove(cache.table, path);
+    return (cache.max_entries && cache.nentries > cache.max_entries) ||
+           (cache.max_bytes && cache.bytes > cache.max_bytes);
 }
 
-static void cache_purge_parent(const char *path)
+static void node_set_stat(struct node *node, const struct stat *stbuf)
+{
+    node->mode = stbuf->st_mode;
+    node->nlink = stbuf->st_nlink;
+    node->size = stbuf->st_size;
+    node->blksize = stbuf->st_blksize;
+    node->mtime = stbuf->st_mtime;
+}
+
+static void node_get_stat(const struct node *node, struct stat *stbuf)
+{
+    memset(stbuf, 0, sizeof(*stbuf));
+    stbuf->st_mode = node->mode;
+    stbuf->st_nlink = node->nlink;
+    stbuf->st_size = node->size;
+    stbuf->st_blksize = node->blksize;
+    if (node->blksize)
+        stbuf->st_blocks =
+            ((node->size + node->blksize - 1) & ~((uint64_t) node->blksize - 1)) >> 9;
+    stbuf->st_atime = stbuf->st_ctime = stbuf->st_mtime = node->mtime;
+}
+
+/* Returns 1 if an entry that expired at valid may still be served while it
+   is being refreshed, i.e. if it is no older than cache.max_stale. */
+static int cache_is_stale_ok(cache_time_t valid, cache_time_t now)
+{
+    return cache.max_stale && valid && now - valid <= cache.max_stale;
+}
+
+static int cache_expired(cache_time_t valid, cache_time_t now)
+{
+    return valid + cache.max_stale < now;
+}
+
+static int dir_listed(const struct cache_dir *dir, cache_time_t now)
+{
+    return dir->dir_valid && !cache_expired(dir->dir_valid, now);
+}
+
+/* NODE_LISTED only means something while the parent has a listing */
+static int node_listed(const struct node *node, cache_time_t now)
+{
+    return (node->flags & NODE_LISTED) && dir_listed(node->dir, now);
+}
+
+static int node_unused(const struct node *node, cache_time_t now)
+{
+    return !node_listed(node, now) &&
+           cache_expired(node->stat_valid, now) &&
+           cache_expired(node->link_valid, now);
+}
+
+static cache_time_t node_expires(const struct node *node, cache_time_t now)
+{
+    cache_time_t valid = MAX(node->stat_valid, node->link_valid);
+    if (node_listed(node, now))
+        valid = MAX(valid, node->dir->dir_valid);
+    return valid + cache.max_stale + 1;
+}
+
+static void heap_set(GPtrArray *heap, uint32_t i, struct cache_timer *t)
+{
+    g_ptr_array_index(heap, i) = t;
+    t->idx = i;
+}
+
+static void heap_up(GPtrArray *heap, uint32_t i)
+{
+    struct cache_timer *t = g_ptr_array_index(heap, i);
+    while (i > 0) {
+        uint32_t parent = (i - 1) / 2;
+        struct cache_timer *p = g_ptr_array_index(heap, parent);
+        if (p->expires <= t->expires)
+            break;
+        heap_set(heap, i, p);
+        i = parent;
+    }
+    heap_set(heap, i, t);
+}
+
+static void heap_down(GPtrArray *heap, uint32_t i)
+{
+    struct cache_timer *t = g_ptr_array_index(heap, i);
+    for (;;) {
+        uint32_t c = 2 * i + 1;
+        struct cache_timer *child;
+        if (c >= heap->len)
+            break;
+        child = g_ptr_array_index(heap, c);
+        if (c + 1 < heap->len) {
+            struct cache_timer *right = g_ptr_array_index(heap, c + 1);
+            if (right->expires < child->expires) {
+                child = right;
+                c++;
+            }
+        }
+        if (child->expires >= t->expires)
+            break;
+        heap_set(heap, i, child);
+        i = c;
+    }
+    heap_set(heap, i, t);
+}
+
+/* Arms t to fire no later than expires. Pushing an armed timer back is
+   left to when it fires. Called with the shard write-locked */
+static void cache_timer_set(struct cache_shard *shard, struct cache_timer *t,
+                            cache_time_t expires)
+{
+    if (t->idx == TIMER_IDLE) {
+        t->expires = expires;
+        g_ptr_array_add(shard->timers, t);
+        heap_up(shard->timers, shard->timers->len - 1);
+    } else if (expires < t->expires) {
+        t->expires = expires;
+        heap_up(shard->timers, t->idx);
+    }
+}
+
+/* Called with the shard write-locked */
+static void cache_timer_del(struct cache_shard *shard, struct cache_timer *t)
+{
+    GPtrArray *heap = shard->timers;
+    struct cache_timer *last;
+    uint32_t i = t->idx;
+
+    if (i == TIMER_IDLE)
+        return;
+    t->idx = TIMER_IDLE;
+    last = g_ptr_array_index(heap, heap->len - 1);
+    g_ptr_array_set_size(heap, heap->len - 1);
+    if (last != t) {
+        heap_set(heap, i, last);
+        heap_up(heap, i);
+        heap_down(heap, last->idx);
+    }
+}
+
+static struct cache_dir *cache_lookup_dir(struct cache_shard *shard,
+                                          const char *path)
+{
+    return (struct cache_dir *) g_hash_table_lookup(shard->dirs, path);
+}
+
+static struct node *cache_lookup_entry(struct cache_dir *dir, const char *name)
+{
+    char *key = (char *) g_hash_table_lookup(dir->entries, name);
+    return key ? node_of(key) : NULL;
+}
+
+static struct node *cache_lookup(struct cache_shard *shard,
+                                 const struct cache_path *cp)
+{
+    struct cache_dir *dir = cache_lookup_dir(shard, cp->dir);
+    return dir ? cache_lookup_entry(dir, cp->name) : NULL;
+}
+
+/* The *_locked functions are called with cache.clock_lock held, all of them
+   with the shard write-locked */
+static void cache_remove_dir_locked(struct cache_shard *shard,
+                                    struct cache_dir *dir)
+{
+    cache_timer_del(shard, &dir->timer);
+    cache.bytes -= dir_bytes(dir);
+    g_hash_table_remove(shard->dirs, dir->path);
+}
+
+static void cache_remove_dir(struct cache_shard *shard, struct cache_dir *dir)
+{
+    pthread_mutex_lock(&cache.clock_lock);
+    cache_remove_dir_locked(shard, dir);
+    pthread_mutex_unlock(&cache.clock_lock);
+}
+
+/* Removes node, and its directory too if nothing is left in it */
+static void cache_remove_node_locked(struct cache_shard *shard,
+                                     struct node *node, cache_time_t now)
+{
+    struct cache_dir *dir = node->dir;
+
+    cache_timer_del(shard, &node->timer);
+    cache_unlink_node_locked(node);
+    g_hash_table_remove(dir->entries, node->name);
+    if (!dir_listed(dir, now) && g_hash_table_size(dir->entries) == 0)
+        cache_remove_dir_locked(shard, dir);
+}
+
+static void cache_remove_node(struct cache_shard *shard, struct node *node,
+                              cache_time_t now)
+{
+    pthread_mutex_lock(&cache.clock_lock);
+    cache_remove_node_locked(shard, node, now);
+    pthread_mutex_unlock(&cache.clock_lock);
+}
+
+#define CACHE_EXPIRE_BATCH 32
+
+/* Reclaims up to CACHE_EXPIRE_BATCH expired entries, so that the cost of
+   expiry is spread over the requests adding entries. Called with the shard
+   write-locked */
+static void cache_expire(struct cache_shard *shard)
+{
+    cache_time_t now = cache_now();
+    int n;
+
+    for (n = 0; n < CACHE_EXPIRE_BATCH && shard->timers->len; n++) {
+        struct cache_timer *t = g_ptr_array_index(shard->timers, 0);
+        if (t->expires > now)
+            break;
+        cache_timer_del(shard, t);
+        if (t->is_dir) {
+            struct cache_dir *dir = timer_owner(t, struct cache_dir);
+            if (dir_listed(dir, now))
+                cache_timer_set(shard, t, dir->dir_valid + cache.max_stale + 1);
+            else {
+                dir->dir_valid = 0;
+                if (g_hash_table_size(dir->entries) == 0)
+                    cache_remove_dir(shard, dir);
+            }
+        } else {
+            struct node *node = timer_owner(t, struct node);
+            if (node_unused(node, now))
+                cache_remove_node(shard, node, now);
+            else
+                cache_timer_set(shard, t, node_expires(node, now));
+        }
+    }
+}
+
+/* Called with cache.clock_lock held and the shard of node write-locked */
+static void cache_evict_node(struct cache_shard *shard, struct node *node)
+{
+    /* The listing of the parent isn't complete any more */
+    if (node->flags & NODE_LISTED)
+        node->dir->dir_valid = 0;
+    cache_remove_node_locked(shard, node, cache_now());
+    cache.evictions++;
+}
+
+/* Evicts entries until the cache fits into cache_max_entries and
+   cache_max_bytes again. Must be called without any shard locked. */
+static void cache_evict(void)
+{
+    unsigned scanned = 0;
+
+    pthread_mutex_lock(&cache.clock_lock);
+    while (cache_over_budget() && scanned < 2 * cache.clock->len) {
+        struct node *node;
+        struct cache_shard *shard;
+
+        if (cache.clock_hand >= cache.clock->len)
+            cache.clock_hand = 0;
+        node = (struct node *) g_ptr_array_index(cache.clock, cache.clock_hand);
+        scanned++;
+        if (__atomic_load_n(&node->referenced, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&node->referenced, 0, __ATOMIC_RELAXED);
+            cache.clock_hand++;
+            continue;
+        }
+        /* Lock order is shard before clock_lock, so don't wait here */
+        shard = cache_shard(node->dir->path);
+        if (pthread_rwlock_trywrlock(&shard->lock) != 0) {
+            cache.clock_hand++;
+            continue;
+        }
+        /* A rename may have moved the directory to another shard before
+           the lock was taken */
+        if (cache_shard(node->dir->path) != shard) {
+            pthread_rwlock_unlock(&shard->lock);
+            cache.clock_hand++;
+            continue;
+        }
+        /* The last entry took the place of the evicted one */
+        cache_evict_node(shard, node);
+        pthread_rwlock_unlock(&shard->lock);
+    }
+    pthread_mutex_unlock(&cache.clock_lock);
+}
+
+static void cache_invalidate(const char *path)
+{
+    struct cache_path cp;
+    struct cache_shard *shard;
+    struct cache_dir *dir;
+    cache_time_t now = cache_now();
+
+    cache_split(&cp, path);
+    shard = cache_shard(cp.dir);
+    pthread_rwlock_wrlock(&shard->lock);
+    dir = cache_lookup_dir(shard, cp.dir);
+    if (dir != NULL) {
+        struct node *node = cache_lookup_entry(dir, cp.name);
+        if (node != NULL) {
+            node->stat_valid = node->link_valid = 0;
+            node->flags &= ~NODE_NOT_FOUND;
+            if (node->link != NULL) {
+                cache_charge(-(long long) (strlen(node->link) + 1));
+                g_free(node->link);
+                node->link = NULL;
+            }
+            if (!node_listed(node, now))
+                cache_remove_node(shard, node, now);
+        }
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    cache_path_free(&cp);
+
+    /* If path is a directory, forget its listing as well. The entries only
+       kept for the listing are reclaimed when their timers fire. */
+    shard = cache_shard(path);
+    pthread_rwlock_wrlock(&shard->lock);
+    dir = cache_lookup_dir(shard, path);
+    if (dir != NULL) {
+        dir->dir_valid = 0;
+        if (g_hash_table_size(dir->entries) == 0)
+            cache_remove_dir(shard, dir);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+}
+
+static void cache_invalidate_parent(const char *path)
 {
     const char *s = strrchr(path, '/');
     if (s) {
         if (s == path)
-            g_hash_table_remove(cache.table, "/");
+            cache_invalidate("/");
         else {
             char *parent = g_strndup(path, s - path);
-            cache_purge(parent);
+            cache_invalidate(parent);
             g_free(parent);
         }
     }
 }
 
-static void cache_invalidate(const char *path)
-{
-    pthread_mutex_lock(&cache.lock);
-    cache_purge(path);
-    pthread_mutex_unlock(&cache.lock);
-}
-
 static void cache_invalidate_dir(const char *path)
 {
-    pthread_mutex_lock(&cache.lock);
-    cache_purge(path);
-    cache_purge_parent(path);
-    pthread_mutex_unlock(&cache.lock);
+    cache_invalidate(path);
+    cache_invalidate_parent(path);
 }
 
-static void cache_do_rename(const char *from, const char *to)
+/* Called with the shard write-locked */
+static struct cache_dir *cache_get_dir(struct cache_shard *shard,
+                                       const char *path)
 {
-    pthread_mutex_lock(&cache.lock);
-    cache_purge(from);
-    cache_purge(to);
-    cache_purge_parent(from);
-    cache_purge_parent(to);
-    pthread_mutex_unlock(&cache.lock);
+    struct cache_dir *dir = cache_lookup_dir(shard, path);
+    if (dir == NULL) {
+        dir = g_new0(struct cache_dir, 1);
+        dir->path = g_strdup(path);
+        dir->timer.idx = TIMER_IDLE;
+        dir->timer.is_dir = 1;
+        dir->entries = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                             free_node, NULL);
+        g_hash_table_insert(shard->dirs, dir->path, dir);
+        cache_charge(dir_bytes(dir));
+    }
+    return dir;
 }
 
-static struct node *cache_get(const char *path)
+/* Called with the shard write-locked */
+static struct node *cache_get_entry(struct cache_dir *dir, const char *name)
 {
-    struct node *node = cache_lookup(path);
+    struct node *node = cache_lookup_entry(dir, name);
     if (node == NULL) {
-        char *pathcopy = g_strdup(path);
-        node = g_new0(struct node, 1);
-        g_hash_table_insert(cache.table, pathcopy, node);
+        size_t len = strlen(name);
+        node = g_malloc0(offsetof(struct node, name) + len + 1);
+        memcpy(node->name, name, len + 1);
+        node->dir = dir;
+        node->timer.idx = TIMER_IDLE;
+        g_hash_table_insert(dir->entries, node->name, node->name);
+        cache_link_node(node);
+    } else {
+        node_touch(node);
     }
     return node;
 }
 
+/* Operations on whole subtrees need every shard, the locks are always taken
+   in index order */
+static void cache_lock_all(void)
+{
+    int i;
+    for (i = 0; i < CACHE_SHARDS; i++)
+        pthread_rwlock_wrlock(&cache.shards[i].shard.lock);
+}
+
+static void cache_unlock_all(void)
+{
+    int i;
+    for (i = CACHE_SHARDS - 1; i >= 0; i--)
+        pthread_rwlock_unlock(&cache.shards[i].shard.lock);
+}
+
+/* Returns 1 if path is root or lies below it */
+static int cache_in_subtree(const char *path, const char *root)
+{
+    size_t len = strlen(root);
+    if (len == 1)
+        return 1;
+    return strncmp(path, root, len) == 0 &&
+           (path[len] == '\0' || path[len] == '/');
+}
+
+/* Disarms the timers of dir and its entries, which are kept in the heap of
+   the shard holding dir */
+static void cache_disarm_dir(struct cache_shard *shard, struct cache_dir *dir)
+{
+    GHashTableIter iter;
+    gpointer name;
+
+    cache_timer_del(shard, &dir->timer);
+    g_hash_table_iter_init(&iter, dir->entries);
+    while (g_hash_table_iter_next(&iter, &name, NULL))
+        cache_timer_del(shard, &node_of(name)->timer);
+}
+
+static void cache_arm_dir(struct cache_shard *shard, struct cache_dir *dir,
+                          cache_time_t now)
+{
+    GHashTableIter iter;
+    gpointer name;
+
+    if (dir->dir_valid)
+        cache_timer_set(shard, &dir->timer,
+                        dir->dir_valid + cache.max_stale + 1);
+    g_hash_table_iter_init(&iter, dir->entries);
+    while (g_hash_table_iter_next(&iter, &name, NULL)) {
+        struct node *node = node_of(name);
+        cache_timer_set(shard, &node->timer, node_expires(node, now));
+    }
+}
+
+/* Takes the entries of dir off the clock. Called with cache.clock_lock held
+   and dir already disarmed; freeing dir frees the entries. */
+static void cache_unlink_dir_locked(struct cache_dir *dir)
+{
+    GHashTableIter iter;
+    gpointer name;
+
+    g_hash_table_iter_init(&iter, dir->entries);
+    while (g_hash_table_iter_next(&iter, &name, NULL))
+        cache_unlink_node_locked(node_of(name));
+    cache.bytes -= dir_bytes(dir);
+}
+
+/* Removes the record of the directory path together with everything cached
+   in it */
+static void cache_drop_dir(const char *path)
+{
+    struct cache_shard *shard = cache_shard(path);
+    struct cache_dir *dir;
+
+    pthread_rwlock_wrlock(&shard->lock);
+    dir = cache_lookup_dir(shard, path);
+    if (dir != NULL) {
+        pthread_mutex_lock(&cache.clock_lock);
+        cache_disarm_dir(shard, dir);
+        cache_unlink_dir_locked(dir);
+        g_hash_table_remove(shard->dirs, dir->path);
+        pthread_mutex_unlock(&cache.clock_lock);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+}
+
+/* Removes every directory record at or below root, together with
+   everything cached in it. Called with all shards write-locked */
+static void cache_drop_subtree(const char *root)
+{
+    int i;
+
+    pthread_mutex_lock(&cache.clock_lock);
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        struct cache_shard *shard = &cache.shards[i].shard;
+        GHashTableIter iter;
+        gpointer key, value;
+
+        g_hash_table_iter_init(&iter, shard->dirs);
+        while (g_hash_table_iter_next(&iter, &key, &value)) {
+            struct cache_dir *dir = (struct cache_dir *) value;
+            if (cache_in_subtree(dir->path, root)) {
+                cache_disarm_dir(shard, dir);
+                cache_unlink_dir_locked(dir);
+                g_hash_table_iter_remove(&iter);
+            }
+        }
+    }
+    pthread_mutex_unlock(&cache.clock_lock);
+}
+
+/* Removes the entry for path. Called with all shards write-locked */
+static void cache_drop_entry(const char *path, cache_time_t now)
+{
+    struct cache_path cp;
+    struct cache_shard *shard;
+    struct node *node;
+
+    cache_split(&cp, path);
+    shard = cache_shard(cp.dir);
+    node = cache_lookup(shard, &cp);
+    if (node != NULL) {
+        if (node->flags & NODE_LISTED)
+            node->dir->dir_valid = 0;
+        cache_remove_node(shard, node, now);
+    }
+    cache_path_free(&cp);
+}
+
+/* Moves the entry for from to to, keeping its attributes. Called with all
+   shards write-locked and nothing cached for to. */
+static void cache_move_entry(const char *from, const char *to,
+                             cache_time_t now)
+{
+    struct cache_path cp;
+    struct cache_shard *shard;
+    struct node *node;
+
+    cache_split(&cp, from);
+    shard = cache_shard(cp.dir);
+    node = cache_lookup(shard, &cp);
+    if (node != NULL) {
+        struct cache_path to_cp;
+        struct cache_shard *to_shard;
+        struct node *to_node;
+
+        cache_split(&to_cp, to);
+        to_shard = cache_shard(to_cp.dir);
+        to_node = cache_get_entry(cache_get_dir(to_shard, to_cp.dir),
+                                  to_cp.name);
+        to_node->size = node->size;
+        to_node->mtime = node->mtime;
+        to_node->mode = node->mode;
+        to_node->nlink = node->nlink;
+        to_node->blksize = node->blksize;
+        to_node->stat_valid = node->stat_valid;
+        to_node->link_valid = node->link_valid;
+        to_node->flags = node->flags & NODE_NOT_FOUND;
+        if (node->link != NULL) {
+            to_node->link = g_strdup(node->link);
+            cache_charge(strlen(node->link) + 1);
+        }
+        cache_timer_set(to_shard, &to_node->timer, node_expires(to_node, now));
+        cache_path_free(&to_cp);
+
+        if (node->flags & NODE_LISTED)
+            node->dir->dir_valid = 0;
+        cache_remove_node(shard, node, now);
+    }
+    cache_path_free(&cp);
+}
+
+/* Re-keys every directory record at or below from to the same place below
+   to. Called with all shards write-locked and nothing cached below to. */
+static void cache_move_subtree(const char *from, const char *to,
+                               cache_time_t now)
+{
+    GPtrArray *moved = g_ptr_array_new();
+    size_t from_len = strlen(from);
+    guint j;
+    int i;
+
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        struct cache_shard *shard = &cache.shards[i].shard;
+        GHashTableIter iter;
+        gpointer key, value;
+
+        g_hash_table_iter_init(&iter, shard->dirs);
+        while (g_hash_table_iter_next(&iter, &key, &value)) {
+            struct cache_dir *dir = (struct cache_dir *) value;
+            if (cache_in_subtree(dir->path, from)) {
+                cache_disarm_dir(shard, dir);
+                g_hash_table_iter_steal(&iter);
+                g_ptr_array_add(moved, dir);
+            }
+        }
+    }
+
+    /* cache_evict() finds the shard of an entry from the path of its
+       directory with only clock_lock held */
+    pthread_mutex_lock(&cache.clock_lock);
+    for (j = 0; j < moved->len; j++) {
+        struct cache_dir *dir = g_ptr_array_index(moved, j);
+        char *path = g_strconcat(to, dir->path + from_len, NULL);
+        struct cache_shard *shard = cache_shard(path);
+
+        cache.bytes += (long long) strlen(path) - (long long) strlen(dir->path);
+        g_free(dir->path);
+        dir->path = path;
+        g_hash_table_insert(shard->dirs, dir->path, dir);
+        cache_arm_dir(shard, dir, now);
+    }
+    pthread_mutex_unlock(&cache.clock_lock);
+    g_ptr_array_free(moved, TRUE);
+}
+
+/* Forgets everything cached below path */
+static void cache_invalidate_tree(const char *path)
+{
+    cache_lock_all();
+    cache_drop_subtree(path);
+    cache_unlock_all();
+}
+
+/* Moves what is cached at and below from to to, instead of refetching it all
+   after a directory has been renamed */
+static void cache_do_rename(const char *from, const char *to)
+{
+    cache_time_t now = cache_now();
+
+    cache_lock_all();
+    cache_drop_subtree(to);
+    cache_drop_entry(to, now);
+    cache_move_entry(from, to, now);
+    cache_move_subtree(from, to, now);
+    cache_unlock_all();
+
+    cache_invalidate_parent(from);
+    cache_invalidate_parent(to);
+}
+
 void cache_add_attr(const char *path, const struct stat *stbuf)
 {
+    struct cache_path cp;
+    struct cache_shard *shard;
     struct node *node;
-    time_t now;
+    cache_time_t now = cache_now();
 
-    pthread_mutex_lock(&cache.lock);
-    node = cache_get(path);
-    now = time(NULL);
+    cache_split(&cp, path);
+    shard = cache_shard(cp.dir);
+    pthread_rwlock_wrlock(&shard->lock);
+    node = cache_get_entry(cache_get_dir(shard, cp.dir), cp.name);
     if (stbuf) {
-      node->stat = *stbuf;
-      node->not_found = 0;
+      node_set_stat(node, stbuf);
+      node->flags &= ~NODE_NOT_FOUND;
     } else {
-      node->not_found = 1;
+      node->flags |= NODE_NOT_FOUND;
     }
     node->stat_valid = now + cache.stat_timeout;
-    if (node->stat_valid > node->valid)
-        node->valid = node->stat_valid;
-    cache_clean();
-    pthread_mutex_unlock(&cache.lock);
+    cache_timer_set(shard, &node->timer, node_expires(node, now));
+    cache_expire(shard);
+    pthread_rwlock_unlock(&shard->lock);
+    cache_path_free(&cp);
+    cache_evict();
 }
 
-void cache_add_dir(const char *path, char **dir)
+static void cache_unlist_entry(void *name, void *value, void *data)
 {
-    struct node *node;
-    time_t now;
+    (void) value;
+    (void) data;
+    node_of(name)->flags &= ~NODE_LISTED;
+}
 
-    pthread_mutex_lock(&cache.lock);
-    node = cache_get(path);
-    now = time(NULL);
-    g_strfreev(node->dir);
-    node->dir = dir;
-    node->not_found = 0;
-    node->dir_valid = now + cache.dir_timeout;
-    if (node->dir_valid > node->valid)
-        node->valid = node->dir_valid;
-    cache_clean();
-    pthread_mutex_unlock(&cache.lock);
+void cache_add_dir(const char *path, char **dir_names)
+{
+    struct cache_shard *shard = cache_shard(path);
+    struct cache_dir *dir;
+    char **name;
+    cache_time_t now = cache_now();
+
+    pthread_rwlock_wrlock(&shard->lock);
+    dir = cache_get_dir(shard, path);
+    g_hash_table_foreach(dir->entries, cache_unlist_entry, NULL);
+    dir->dir_valid = now + cache.dir_timeout;
+    for (name = dir_names; *name != NULL; name++) {
+        struct node *node = cache_get_entry(dir, *name);
+        node->flags |= NODE_LISTED;
+        cache_timer_set(shard, &node->timer, node_expires(node, now));
+    }
+    cache_timer_set(shard, &dir->timer, dir->dir_valid + cache.max_stale + 1);
+    cache_expire(shard);
+    pthread_rwlock_unlock(&shard->lock);
+    g_strfreev(dir_names);
+    cache_evict();
 }
 
 static size_t my_strnlen(const char *s, size_t maxsize)
@@ -182,40 +955,214 @@ static size_t my_strnlen(const char *s, size_t maxsize)
 
 void cache_add_link(const char *path, const char *link, size_t size)
 {
+    struct cache_path cp;
+    struct cache_shard *shard;
     struct node *node;
-    time_t now;
+    size_t len;
+    cache_time_t now = cache_now();
 
-    pthread_mutex_lock(&cache.lock);
-    node = cache_get(path);
-    now = time(NULL);
+    cache_split(&cp, path);
+    shard = cache_shard(cp.dir);
+    pthread_rwlock_wrlock(&shard->lock);
+    node = cache_get_entry(cache_get_dir(shard, cp.dir), cp.name);
+    len = my_strnlen(link, size-1);
+    cache_charge((long long) len + 1 -
+                 (node->link ? (long long) strlen(node->link) + 1 : 0));
     g_free(node->link);
-    node->link = g_strndup(link, my_strnlen(link, size-1));
-    node->not_found = 0;
+    node->link = g_strndup(link, len);
+    node->flags &= ~NODE_NOT_FOUND;
     node->link_valid = now + cache.link_timeout;
-    if (node->link_valid > node->valid)
-        node->valid = node->link_valid;
-    cache_clean();
-    pthread_mutex_unlock(&cache.lock);
+    cache_timer_set(shard, &node->timer, node_expires(node, now));
+    cache_expire(shard);
+    pthread_rwlock_unlock(&shard->lock);
+    cache_path_free(&cp);
+    cache_evict();
+}
+
+/* Records that the directory path has just been modified. Returns its
+   block size, or 0 if not known. */
+static uint32_t cache_touch_dir(const char *path, int nlink_delta)
+{
+    struct cache_path cp;
+    struct cache_shard *shard;
+    struct node *node;
+    uint32_t blksize = 0;
+
+    cache_split(&cp, path);
+    shard = cache_shard(cp.dir);
+    pthread_rwlock_wrlock(&shard->lock);
+    node = cache_lookup(shard, &cp);
+    if (node != NULL && node->stat_valid && !(node->flags & NODE_NOT_FOUND)) {
+        node->mtime = time(NULL);
+        node->nlink += nlink_delta;
+        blksize = node->blksize;
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    cache_path_free(&cp);
+    return blksize;
+}
+
+/* Applies the outcome of creating an entry with the given mode (or of
+   removing it if mode is 0) to the cache: the entry itself, the listing of
+   its directory and the attributes of that directory. This saves listing
+   the directory again for what we already know. */
+static void cache_patch_entry(const char *path, mode_t mode)
+{
+    struct cache_path cp;
+    struct cache_shard *shard;
+    struct cache_dir *dir;
+    struct node *node;
+    cache_time_t now = cache_now();
+    int nlink_delta = S_ISDIR(mode) ? 1 : 0;
+    uint32_t blksize;
+
+    cache_split(&cp, path);
+    if (!mode) {
+        /* A removed directory takes its link to the parent along */
+        struct cache_shard *dir_shard = cache_shard(cp.dir);
+        pthread_rwlock_rdlock(&dir_shard->lock);
+        node = cache_lookup(dir_shard, &cp);
+        if (node != NULL && node->stat_valid && S_ISDIR(node->mode))
+            nlink_delta = -1;
+        pthread_rwlock_unlock(&dir_shard->lock);
+    }
+    blksize = cache_touch_dir(cp.dir, nlink_delta);
+
+    shard = cache_shard(cp.dir);
+    pthread_rwlock_wrlock(&shard->lock);
+    dir = cache_get_dir(shard, cp.dir);
+    node = cache_get_entry(dir, cp.name);
+    if (node->link != NULL) {
+        cache_charge(-(long long) (strlen(node->link) + 1));
+        g_free(node->link);
+        node->link = NULL;
+    }
+    node->link_valid = 0;
+    if (mode) {
+        node->mode = mode;
+        node->nlink = S_ISDIR(mode) ? 2 : 1;
+        node->size = 0;
+        node->blksize = blksize;
+        node->mtime = time(NULL);
+        node->flags &= ~NODE_NOT_FOUND;
+        if (dir_listed(dir, now))
+            node->flags |= NODE_LISTED;
+    } else {
+        node->flags |= NODE_NOT_FOUND;
+        node->flags &= ~NODE_LISTED;
+    }
+    node->stat_valid = now + cache.stat_timeout;
+    cache_timer_set(shard, &node->timer, node_expires(node, now));
+    cache_expire(shard);
+    pthread_rwlock_unlock(&shard->lock);
+    cache_path_free(&cp);
+
+    /* A new directory is known to be empty */
+    if (S_ISDIR(mode))
+        cache_add_dir(path, g_new0(char *, 1));
+    cache_evict();
+}
+
+/* Sets the size of path to size, or grows it to size if grow is set, if
+   its attributes are cached */
+static void cache_patch_size(const char *path, off_t size, int grow)
+{
+    struct cache_path cp;
+    struct cache_shard *shard;
+    struct node *node;
+
+    cache_split(&cp, path);
+    shard = cache_shard(cp.dir);
+    pthread_rwlock_wrlock(&shard->lock);
+    node = cache_lookup(shard, &cp);
+    if (node != NULL && node->stat_valid && !(node->flags & NODE_NOT_FOUND)) {
+        if (!grow || (uint64_t) size > node->size)
+            node->size = size;
+        node->mtime = time(NULL);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    cache_path_free(&cp);
+}
+
+static void *cache_refresh_thread(void *data);
+
+/* Called with the shard holding the flags locked, possibly only for reading:
+   the refreshing flags are protected by cache.refresh_lock */
+static void cache_schedule_refresh(const char *path, unsigned char *refreshing,
+                                   int what)
+{
+    struct refresh_req *req;
+
+    pthread_mutex_lock(&cache.refresh_lock);
+    if (*refreshing & what) {
+        pthread_mutex_unlock(&cache.refresh_lock);
+        return;
+    }
+    if (!cache.refresh_started) {
+        int err = pthread_create(&cache.refresh_thread, NULL,
+                                 cache_refresh_thread, NULL);
+        if (err) {
+            fprintf(stderr, "failed to create refresh thread: %s\n",
+                    strerror(err));
+            pthread_mutex_unlock(&cache.refresh_lock);
+            return;
+        }
+        cache.refresh_started = 1;
+    }
+    req = g_new(struct refresh_req, 1);
+    req->path = g_strdup(path);
+    req->what = what;
+    g_queue_push_tail(cache.refresh_queue, req);
+    *refreshing |= what;
+    pthread_cond_signal(&cache.refresh_cond);
+    pthread_mutex_unlock(&cache.refresh_lock);
+}
+
+/* Lookups only hold the shard read-locked, so the counters are updated
+   atomically */
+static void cache_count(struct cache_shard *shard, const char *path,
+                        const char *what, int hit)
+{
+    (void) path;    /* only used by the probes */
+    (void) what;
+    if (hit) {
+        __sync_fetch_and_add(&shard->hits, 1);
+        PROBE(cache_hit, path, what);
+    } else {
+        __sync_fetch_and_add(&shard->misses, 1);
+        PROBE(cache_miss, path, what);
+    }
 }
 
 static int cache_get_attr(const char *path, struct stat *stbuf)
 {
+    struct cache_path cp;
+    struct cache_shard *shard;
     struct node *node;
     int err = -EAGAIN;
-    pthread_mutex_lock(&cache.lock);
-    node = cache_lookup(path);
+
+    cache_split(&cp, path);
+    shard = cache_shard(cp.dir);
+    pthread_rwlock_rdlock(&shard->lock);
+    node = cache_lookup(shard, &cp);
     if (node != NULL) {
-        time_t now = time(NULL);
-        if (node->stat_valid - now >= 0) {
-            if (node->not_found) {
+        cache_time_t now = cache_now();
+        int fresh = node->stat_valid >= now;
+        if (fresh || cache_is_stale_ok(node->stat_valid, now)) {
+            if (node->flags & NODE_NOT_FOUND) {
               err = -ENOENT;
             } else {
-              *stbuf = node->stat;
+              node_get_stat(node, stbuf);
               err = 0;
             }
+            node_touch(node);
+            if (!fresh)
+                cache_schedule_refresh(path, &node->refreshing, REFRESH_STAT);
         }
     }
-    pthread_mutex_unlock(&cache.lock);
+    cache_count(shard, path, "attr", err != -EAGAIN);
+    pthread_rwlock_unlock(&shard->lock);
+    cache_path_free(&cp);
     return err;
 }
 
@@ -234,21 +1181,29 @@ static int cache_getattr(const char *path, struct stat *stbuf)
 
 static int cache_readlink(const char *path, char *buf, size_t size)
 {
+    struct cache_path cp;
+    struct cache_shard *shard;
     struct node *node;
     int err;
 
-    pthread_mutex_lock(&cache.lock);
-    node = cache_lookup(path);
-    if (node != NULL) {
-        time_t now = time(NULL);
-        if (node->link_valid - now >= 0) {
+    cache_split(&cp, path);
+    shard = cache_shard(cp.dir);
+    pthread_rwlock_rdlock(&shard->lock);
+    node = cache_lookup(shard, &cp);
+    if (node != NULL && node->link != NULL) {
+        if (node->link_valid >= cache_now()) {
             strncpy(buf, node->link, size-1);
             buf[size-1] = '\0';
-            pthread_mutex_unlock(&cache.lock);
+            node_touch(node);
+            cache_count(shard, path, "link", 1);
+            pthread_rwlock_unlock(&shard->lock);
+            cache_path_free(&cp);
             return 0;
         }
     }
-    pthread_mutex_unlock(&cache.lock);
+    cache_count(shard, path, "link", 0);
+    pthread_rwlock_unlock(&shard->lock);
+    cache_path_free(&cp);
     err = cache.next_oper->oper.readlink(path, buf, size);
     if (!err)
         cache_add_link(path, buf, size);
@@ -256,75 +1211,292 @@ static int cache_readlink(const char *path, char *buf, size_t size)
     return err;
 }
 
+/* Passes an entry on through whichever of getdir and readdir the directory
+   is being read with */
+static int cache_fill(fuse_cache_dirh_t ch, const char *name,
+                      const struct stat *stbuf)
+{
+#if FUSE_VERSION >= 23
+    if (ch->fill_dir)
+        return ch->fill_dir(ch->buf, name, stbuf, 0);
+#endif
+    if (ch->filler)
+        return ch->filler(ch->h, name,
+                          stbuf ? (stbuf->st_mode & S_IFMT) >> 12 : 0, 0);
+    return 0;
+}
+
+static void cache_dirhandle_init(struct fuse_cache_dirhandle *ch,
+                                 const char *path)
+{
+    memset(ch, 0, sizeof(*ch));
+    ch->path = path;
+}
+
+/* Caches the attributes of entries of the same directory under one lock,
+   instead of taking it for each of them. Nothing is evicted until the whole
+   listing is known to fit, see cache_fetch_dir(). */
+static void cache_add_attrs(const char *path, char **names,
+                            const struct stat *stbufs, guint n)
+{
+    struct cache_shard *shard = cache_shard(path);
+    struct cache_dir *dir;
+    cache_time_t now = cache_now();
+    guint i;
+
+    pthread_rwlock_wrlock(&shard->lock);
+    dir = cache_get_dir(shard, path);
+    for (i = 0; i < n; i++) {
+        struct node *node = cache_get_entry(dir, names[i]);
+        node_set_stat(node, &stbufs[i]);
+        node->flags &= ~NODE_NOT_FOUND;
+        node->stat_valid = now + cache.stat_timeout;
+        cache_timer_set(shard, &node->timer, node_expires(node, now));
+    }
+    cache_expire(shard);
+    pthread_rwlock_unlock(&shard->lock);
+}
+
+static void cache_flush_attrs(struct fuse_cache_dirhandle *ch)
+{
+    guint n = ch->dir->len - ch->batch_start;
+
+    if (n)
+        cache_add_attrs(ch->path, (char **) ch->dir->pdata + ch->batch_start,
+                        ch->batch, n);
+    ch->batch_start = ch->dir->len;
+}
+
 static int cache_dirfill(fuse_cache_dirh_t ch, const char *name,
                          const struct stat *stbuf)
 {
-    int err = ch->filler(ch->h, name, 0, 0);
-    if (!err) {
-        char *fullpath;
+    int err = cache_fill(ch, name, stbuf);
+    if (!err && !ch->oversized) {
+        ch->bytes += offsetof(struct node, name) + strlen(name) + 1;
+        if ((cache.max_entries && ch->dir->len >= cache.max_entries) ||
+            (cache.max_bytes && ch->bytes > cache.max_bytes)) {
+            ch->oversized = 1;
+            return 0;
+        }
+        if (stbuf == NULL) {
+            char *fullpath;
+            cache_flush_attrs(ch);
+            fullpath = g_strdup_printf("%s/%s", !ch->path[1] ? "" : ch->path,
+                                       name);
+            cache_add_attr(fullpath, NULL);
+            g_free(fullpath);
+            g_ptr_array_add(ch->dir, g_strdup(name));
+            ch->batch_start = ch->dir->len;
+            return 0;
+        }
+        ch->batch[ch->dir->len - ch->batch_start] = *stbuf;
         g_ptr_array_add(ch->dir, g_strdup(name));
-        fullpath = g_strdup_printf("%s/%s", !ch->path[1] ? "" : ch->path, name);
-        cache_add_attr(fullpath, stbuf);
-        g_free(fullpath);
+        if (ch->dir->len - ch->batch_start == CACHE_ATTR_BATCH)
+            cache_flush_attrs(ch);
     }
     return err;
 }
 
-static int cache_getdir(const char *path, fuse_dirh_t h, fuse_dirfil_t filler)
+static int cache_fetch_dir(const char *path, struct fuse_cache_dirhandle *ch)
 {
-    struct fuse_cache_dirhandle ch;
     int err;
     char **dir;
-    struct node *node;
 
-    pthread_mutex_lock(&cache.lock);
-    node = cache_lookup(path);
-    if (node != NULL && node->dir != NULL) {
-        time_t now = time(NULL);
-        if (node->dir_valid - now >= 0) {
-            for(dir = node->dir; *dir != NULL; dir++)
-                filler(h, *dir, 0, 0);
-            pthread_mutex_unlock(&cache.lock);
+    ch->dir = g_ptr_array_new();
+    ch->batch = g_new(struct stat, CACHE_ATTR_BATCH);
+    ch->batch_start = 0;
+    ch->bytes = 0;
+    ch->oversized = 0;
+    err = cache.next_oper->cache_getdir(path, ch, cache_dirfill);
+    if (!ch->oversized)
+        cache_flush_attrs(ch);
+    g_free(ch->batch);
+    g_ptr_array_add(ch->dir, NULL);
+    dir = (char **) ch->dir->pdata;
+    g_ptr_array_free(ch->dir, FALSE);
+    if (!err && !ch->oversized) {
+        cache_add_dir(path, dir);
+        return 0;
+    }
+    g_strfreev(dir);
+    /* A listing bigger than the whole cache would only push everything else
+       out and then lose entries of its own, so it is passed on uncached and
+       what was cached of it so far is dropped */
+    if (ch->oversized)
+        cache_drop_dir(path);
+    cache_evict();
+    return err;
+}
+
+/* Lists path from the cache along with the cached attributes of its
+   entries, or fetches it if it isn't cached */
+static int cache_list_dir(const char *path, struct fuse_cache_dirhandle *ch)
+{
+    struct cache_shard *shard = cache_shard(path);
+    struct cache_dir *dir;
+
+    pthread_rwlock_rdlock(&shard->lock);
+    dir = cache_lookup_dir(shard, path);
+    if (dir != NULL && dir->dir_valid) {
+        cache_time_t now = cache_now();
+        int fresh = dir->dir_valid >= now;
+        if (fresh || cache_is_stale_ok(dir->dir_valid, now)) {
+            GHashTableIter iter;
+            gpointer name;
+            g_hash_table_iter_init(&iter, dir->entries);
+            while (g_hash_table_iter_next(&iter, &name, NULL)) {
+                struct node *node = node_of(name);
+                struct stat stbuf;
+                int has_stat;
+                if (!(node->flags & NODE_LISTED))
+                    continue;
+                node_touch(node);
+                has_stat = !(node->flags & NODE_NOT_FOUND) &&
+                    (node->stat_valid >= now ||
+                     cache_is_stale_ok(node->stat_valid, now));
+                if (has_stat)
+                    node_get_stat(node, &stbuf);
+                if (cache_fill(ch, (const char *) name,
+                               has_stat ? &stbuf : NULL))
+                    break;
+            }
+            if (!fresh)
+                cache_schedule_refresh(path, &dir->refreshing, REFRESH_DIR);
+            cache_count(shard, path, "dir", 1);
+            pthread_rwlock_unlock(&shard->lock);
             return 0;
         }
     }
-    pthread_mutex_unlock(&cache.lock);
+    cache_count(shard, path, "dir", 0);
+    pthread_rwlock_unlock(&shard->lock);
 
-    ch.path = path;
+    return cache_fetch_dir(path, ch);
+}
+
+#if FUSE_VERSION < 23
+static int cache_getdir(const char *path, fuse_dirh_t h, fuse_dirfil_t filler)
+{
+    struct fuse_cache_dirhandle ch;
+
+    cache_dirhandle_init(&ch, path);
     ch.h = h;
     ch.filler = filler;
-    ch.dir = g_ptr_array_new();
-    err = cache.next_oper->cache_getdir(path, &ch, cache_dirfill);
-    g_ptr_array_add(ch.dir, NULL);
-    dir = (char **) ch.dir->pdata;
-    if (!err)
-        cache_add_dir(path, dir);
-    else
-        g_strfreev(dir);
-    g_ptr_array_free(ch.dir, FALSE);
-    return err;
+    return cache_list_dir(path, &ch);
+}
+#else
+static int cache_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                         off_t offset, struct fuse_file_info *fi)
+{
+    struct fuse_cache_dirhandle ch;
+
+    (void) offset;
+    (void) fi;
+    cache_dirhandle_init(&ch, path);
+    ch.buf = buf;
+    ch.fill_dir = filler;
+    return cache_list_dir(path, &ch);
+}
+#endif
+
+static void cache_refresh(struct refresh_req *req)
+{
+    if (req->what & REFRESH_STAT) {
+        struct cache_path cp;
+        struct cache_shard *shard;
+        struct node *node;
+        struct stat stbuf;
+        int err = cache.next_oper->oper.getattr(req->path, &stbuf);
+        if (!err)
+            cache_add_attr(req->path, &stbuf);
+        else if (err == -ENOENT)
+            cache_add_attr(req->path, NULL);
+
+        cache_split(&cp, req->path);
+        shard = cache_shard(cp.dir);
+        pthread_rwlock_rdlock(&shard->lock);
+        node = cache_lookup(shard, &cp);
+        if (node != NULL) {
+            pthread_mutex_lock(&cache.refresh_lock);
+            node->refreshing &= ~REFRESH_STAT;
+            pthread_mutex_unlock(&cache.refresh_lock);
+        }
+        pthread_rwlock_unlock(&shard->lock);
+        cache_path_free(&cp);
+    }
+    if (req->what & REFRESH_DIR) {
+        struct cache_shard *shard = cache_shard(req->path);
+        struct cache_dir *dir;
+
+        struct fuse_cache_dirhandle ch;
+
+        cache_dirhandle_init(&ch, req->path);
+        cache_fetch_dir(req->path, &ch);
+
+        pthread_rwlock_rdlock(&shard->lock);
+        dir = cache_lookup_dir(shard, req->path);
+        if (dir != NULL) {
+            pthread_mutex_lock(&cache.refresh_lock);
+            dir->refreshing &= ~REFRESH_DIR;
+            pthread_mutex_unlock(&cache.refresh_lock);
+        }
+        pthread_rwlock_unlock(&shard->lock);
+    }
 }
 
-static int cache_unity_dirfill(fuse_cache_dirh_t ch, const char *name,
-                               const struct stat *stbuf)
+static void *cache_refresh_thread(void *data)
 {
-    (void) stbuf;
-    return ch->filler(ch->h, name, 0, 0);
+    (void) data;
+
+    pthread_mutex_lock(&cache.refresh_lock);
+    while (!cache.refresh_stop) {
+        struct refresh_req *req = g_queue_pop_head(cache.refresh_queue);
+        if (req == NULL) {
+            pthread_cond_wait(&cache.refresh_cond, &cache.refresh_lock);
+            continue;
+        }
+        pthread_mutex_unlock(&cache.refresh_lock);
+
+        cache_refresh(req);
+        g_free(req->path);
+        g_free(req);
+
+        pthread_mutex_lock(&cache.refresh_lock);
+    }
+    pthread_mutex_unlock(&cache.refresh_lock);
+    return NULL;
 }
 
+#if FUSE_VERSION < 23
 static int cache_unity_getdir(const char *path, fuse_dirh_t h,
                               fuse_dirfil_t filler)
 {
     struct fuse_cache_dirhandle ch;
+    cache_dirhandle_init(&ch, path);
     ch.h = h;
     ch.filler = filler;
-    return cache.next_oper->cache_getdir(path, &ch, cache_unity_dirfill);
+    return cache.next_oper->cache_getdir(path, &ch, cache_fill);
+}
+#else
+static int cache_unity_readdir(const char *path, void *buf,
+                               fuse_fill_dir_t filler, off_t offset,
+                               struct fuse_file_info *fi)
+{
+    struct fuse_cache_dirhandle ch;
+    (void) offset;
+    (void) fi;
+    cache_dirhandle_init(&ch, path);
+    ch.buf = buf;
+    ch.fill_dir = filler;
+    return cache.next_oper->cache_getdir(path, &ch, cache_fill);
 }
+#endif
 
 static int cache_mknod(const char *path, mode_t mode, dev_t rdev)
 {
     int err = cache.next_oper->oper.mknod(path, mode, rdev);
-    if (!err)
+    if (!err && S_ISREG(mode))
+        cache_patch_entry(path, mode);
+    else if (!err)
         cache_invalidate_dir(path);
     return err;
 }
@@ -333,7 +1505,7 @@ static int cache_mkdir(const char *path, mode_t mode)
 {
     int err = cache.next_oper->oper.mkdir(path, mode);
     if (!err)
-        cache_invalidate_dir(path);
+        cache_patch_entry(path, S_IFDIR | (mode & 07777));
     return err;
 }
 
@@ -341,15 +1513,17 @@ static int cache_unlink(const char *path)
 {
     int err = cache.next_oper->oper.unlink(path);
     if (!err)
-        cache_invalidate_dir(path);
+        cache_patch_entry(path, 0);
     return err;
 }
 
 static int cache_rmdir(const char *path)
 {
     int err = cache.next_oper->oper.rmdir(path);
-    if (!err)
-        cache_invalidate_dir(path);
+    if (!err) {
+        cache_patch_entry(path, 0);
+        cache_invalidate_tree(path);
+    }
     return err;
 }
 
@@ -399,7 +1573,7 @@ static int cache_truncate(const char *path, off_t size)
 {
     int err = cache.next_oper->oper.truncate(path, size);
     if (!err)
-        cache_invalidate(path);
+        cache_patch_size(path, size, 0);
     return err;
 }
 
@@ -416,7 +1590,7 @@ static int cache_write(const char *path, const char *buf, size_t size,
 {
     int res = cache.next_oper->oper.write(path, buf, size, offset, fi);
     if (res >= 0)
-        cache_invalidate(path);
+        cache_patch_size(path, offset + res, 1);
     return res;
 }
 
@@ -426,7 +1600,7 @@ static int cache_create(const char *path, mode_t mode,
 {
     int err = cache.next_oper->oper.create(path, mode, fi);
     if (!err)
-        cache_invalidate_dir(path);
+        cache_patch_entry(path, S_IFREG | (mode & 07777));
     return err;
 }
 
@@ -435,7 +1609,7 @@ static int cache_ftruncate(const char *path, off_t size,
 {
     int err = cache.next_oper->oper.ftruncate(path, size, fi);
     if (!err)
-        cache_invalidate(path);
+        cache_patch_size(path, size, 0);
     return err;
 }
 
@@ -462,7 +1636,11 @@ static void cache_unity_fill(struct fuse_cache_operations *oper,
 #endif
     cache_oper->getattr     = oper->oper.getattr;
     cache_oper->readlink    = oper->oper.readlink;
+#if FUSE_VERSION >= 23
+    cache_oper->readdir     = cache_unity_readdir;
+#else
     cache_oper->getdir      = cache_unity_getdir;
+#endif
     cache_oper->mknod       = oper->oper.mknod;
     cache_oper->mkdir       = oper->oper.mkdir;
     cache_oper->symlink     = oper->oper.symlink;
@@ -495,13 +1673,18 @@ static void cache_unity_fill(struct fuse_cache_operations *oper,
 struct fuse_operations *cache_init(struct fuse_cache_operations *oper)
 {
     static struct fuse_operations cache_oper;
+    int i;
     cache.next_oper = oper;
 
     cache_unity_fill(oper, &cache_oper);
     if (cache.on) {
         cache_oper.getattr  = oper->oper.getattr ? cache_getattr : NULL;
         cache_oper.readlink = oper->oper.readlink ? cache_readlink : NULL;
+#if FUSE_VERSION >= 23
+        cache_oper.readdir  = oper->cache_getdir ? cache_readdir : NULL;
+#else
         cache_oper.getdir   = oper->cache_getdir ? cache_getdir : NULL;
+#endif
         cache_oper.mknod    = oper->oper.mknod ? cache_mknod : NULL;
         cache_oper.mkdir    = oper->oper.mkdir ? cache_mkdir : NULL;
         cache_oper.symlink  = oper->oper.symlink ? cache_symlink : NULL;
@@ -519,12 +1702,22 @@ struct fuse_operations *cache_init(struct fuse_cache_operations *oper)
         cache_oper.ftruncate = oper->oper.ftruncate ? cache_ftruncate : NULL;
         cache_oper.fgetattr = oper->oper.fgetattr ? cache_fgetattr : NULL;
 #endif
-        pthread_mutex_init(&cache.lock, NULL);
-        cache.table = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
-                                            free_node);
-        if (cache.table == NULL) {
-            fprintf(stderr, "failed to create cache\n");
-            return NULL;
+        pthread_mutex_init(&cache.refresh_lock, NULL);
+        pthread_cond_init(&cache.refresh_cond, NULL);
+        cache.refresh_queue = g_queue_new();
+        cache.epoch = time(NULL) - 1;
+        pthread_mutex_init(&cache.clock_lock, NULL);
+        cache.clock = g_ptr_array_new();
+        for (i = 0; i < CACHE_SHARDS; i++) {
+            struct cache_shard *shard = &cache.shards[i].shard;
+            pthread_rwlock_init(&shard->lock, NULL);
+            shard->dirs = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                NULL, free_dir);
+            shard->timers = g_ptr_array_new();
+            if (shard->dirs == NULL) {
+                fprintf(stderr, "failed to create cache\n");
+                return NULL;
+            }
         }
     }
     return &cache_oper;
@@ -534,16 +1727,162 @@ int cache_enabled(void) {
     return cache.on;
 }
 
+unsigned cache_stat_timeout(void) {
+    return cache.on ? cache.stat_timeout : 0;
+}
+
+static void cache_free_refresh_req(gpointer req_, gpointer data)
+{
+    struct refresh_req *req = (struct refresh_req *) req_;
+    (void) data;
+    g_free(req->path);
+    g_free(req);
+}
+
 void cache_deinit(void) {
-    pthread_mutex_lock(&cache.lock);
+    int i;
+
+    if (!cache.on)
+        return;
+
+    pthread_mutex_lock(&cache.refresh_lock);
+    cache.refresh_stop = 1;
+    pthread_cond_signal(&cache.refresh_cond);
+    pthread_mutex_unlock(&cache.refresh_lock);
+    if (cache.refresh_started)
+        pthread_join(cache.refresh_thread, NULL);
+    if (cache.refresh_queue) {
+        g_queue_foreach(cache.refresh_queue, cache_free_refresh_req, NULL);
+        g_queue_free(cache.refresh_queue);
+        cache.refresh_queue = NULL;
+    }
+    pthread_cond_destroy(&cache.refresh_cond);
+    pthread_mutex_destroy(&cache.refresh_lock);
+
     cache.on = 0;
-    g_hash_table_destroy(cache.table);
-    cache.table = NULL;
-    pthread_mutex_unlock(&cache.lock);
-    pthread_mutex_destroy(&cache.lock);
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        struct cache_shard *shard = &cache.shards[i].shard;
+        pthread_rwlock_wrlock(&shard->lock);
+        g_hash_table_destroy(shard->dirs);
+        shard->dirs = NULL;
+        g_ptr_array_free(shard->timers, TRUE);
+        shard->timers = NULL;
+        pthread_rwlock_unlock(&shard->lock);
+        pthread_rwlock_destroy(&shard->lock);
+    }
+    g_ptr_array_free(cache.clock, TRUE);
+    cache.clock = NULL;
+    pthread_mutex_destroy(&cache.clock_lock);
     return;
 }
 
+void cache_get_stats(struct cache_stats *stats)
+{
+    int i;
+
+    memset(stats, 0, sizeof(*stats));
+    if (!cache.on)
+        return;
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        struct cache_shard *shard = &cache.shards[i].shard;
+        stats->hits += __sync_fetch_and_add(&shard->hits, 0);
+        stats->misses += __sync_fetch_and_add(&shard->misses, 0);
+    }
+    pthread_mutex_lock(&cache.clock_lock);
+    stats->evictions = cache.evictions;
+    stats->entries = cache.nentries;
+    stats->bytes = cache.bytes;
+    pthread_mutex_unlock(&cache.clock_lock);
+}
+
+/* Forgets what is cached about path and, with subtree, everything below it,
+   so that the next lookups go to the server */
+void cache_forget(const char *path, int subtree)
+{
+    if (!cache.on)
+        return;
+    if (subtree)
+        cache_invalidate_tree(path);
+    cache_invalidate_dir(path);
+}
+
+/* Adds to subdirs the paths of the directories in the cached listing of
+   path */
+static void cache_add_subdirs(const char *path, GPtrArray *subdirs)
+{
+    struct cache_shard *shard = cache_shard(path);
+    struct cache_dir *dir;
+
+    pthread_rwlock_rdlock(&shard->lock);
+    dir = cache_lookup_dir(shard, path);
+    if (dir != NULL) {
+        GHashTableIter iter;
+        gpointer name;
+        g_hash_table_iter_init(&iter, dir->entries);
+        while (g_hash_table_iter_next(&iter, &name, NULL)) {
+            struct node *node = node_of(name);
+            if (!(node->flags & NODE_LISTED) ||
+                (node->flags & NODE_NOT_FOUND) || !node->stat_valid ||
+                !S_ISDIR(node->mode) || !strcmp(name, ".") ||
+                !strcmp(name, ".."))
+                continue;
+            g_ptr_array_add(subdirs, g_strdup_printf("%s/%s",
+                                                     path[1] ? path : "",
+                                                     (char *) name));
+        }
+    }
+    pthread_rwlock_unlock(&shard->lock);
+}
+
+/* Lists path and the directories below it, down to depth levels, into the
+   cache. Gives up between two directories once *stop is set. Returns how
+   many directories were listed, -ECANCELED if it gave up, or -errno if path
+   itself could not be listed. */
+int cache_prefetch(const char *path, unsigned depth, const int *stop)
+{
+    GPtrArray *level, *next;
+    unsigned d;
+    int listed = 0, err = 0;
+    guint i;
+
+    if (!cache.on)
+        return -ENOTSUP;
+
+    level = g_ptr_array_new();
+    g_ptr_array_add(level, g_strdup(path));
+    for (d = 0; level->len; d++) {
+        next = g_ptr_array_new();
+        for (i = 0; i < level->len; i++) {
+            char *dirpath = (char *) g_ptr_array_index(level, i);
+            struct fuse_cache_dirhandle ch;
+            int res;
+
+            if (!err && stop && __atomic_load_n(stop, __ATOMIC_RELAXED))
+                err = -ECANCELED;
+            if (err) {
+                g_free(dirpath);
+                continue;
+            }
+            cache_dirhandle_init(&ch, dirpath);
+            res = cache_fetch_dir(dirpath, &ch);
+            if (res) {
+                if (d == 0)
+                    err = res;
+            } else {
+                listed++;
+                if (d < depth)
+                    cache_add_subdirs(dirpath, next);
+            }
+            g_free(dirpath);
+        }
+        g_ptr_array_free(level, TRUE);
+        level = next;
+    }
+    g_ptr_array_free(level, TRUE);
+
+    return err ? err : listed;
+}
+
 static const struct fuse_opt cache_opts[] = {
     { "cache=yes", offsetof(struct cache, on), 1 },
     { "cache=no", offsetof(struct cache, on), 0 },
@@ -553,6 +1892,9 @@ static const struct fuse_opt cache_opts[] = {
     { "cache_stat_timeout=%u", offsetof(struct cache, stat_timeout), 0 },
     { "cache_dir_timeout=%u", offsetof(struct cache, dir_timeout), 0 },
     { "cache_link_timeout=%u", offsetof(struct cache, link_timeout), 0 },
+    { "cache_max_stale=%u", offsetof(struct cache, max_stale), 0 },
+    { "cache_max_entries=%u", offsetof(struct cache, max_entries), 0 },
+    { "cache_max_bytes=%llu", offsetof(struct cache, max_bytes), 0 },
     FUSE_OPT_END
 };
 
@@ -561,7 +1903,59 @@ int cache_parse_options(struct fuse_args *args)
     cache.stat_timeout = DEFAULT_CACHE_TIMEOUT;
     cache.dir_timeout = DEFAULT_CACHE_TIMEOUT;
     cache.link_timeout = DEFAULT_CACHE_TIMEOUT;
+    cache.max_entries = DEFAULT_CACHE_MAX_ENTRIES;
     cache.on = 1;
 
     return fuse_opt_parse(args, &cache, cache_opts, NULL);
 }
+
+#define CACHE_SETTING(name, field) \
+    { name, offsetof(struct cache, field), sizeof(cache.field) }
+
+/* The options cache_set_option() can change. cache_timeout sets the three
+   timeouts, like on the command line. */
+static const struct {
+    const char *name;
+    size_t offset;
+    size_t size;
+} cache_settings[] = {
+    CACHE_SETTING("cache_timeout", stat_timeout),
+    CACHE_SETTING("cache_timeout", dir_timeout),
+    CACHE_SETTING("cache_timeout", link_timeout),
+    CACHE_SETTING("cache_stat_timeout", stat_timeout),
+    CACHE_SETTING("cache_dir_timeout", dir_timeout),
+    CACHE_SETTING("cache_link_timeout", link_timeout),
+    CACHE_SETTING("cache_max_stale", max_stale),
+    CACHE_SETTING("cache_max_entries", max_entries),
+    CACHE_SETTING("cache_max_bytes", max_bytes),
+};
+
+/* Changes one of the numeric cache_* options while mounted. Entries cached
+   from now on get the new timeouts, lower limits are enforced right away.
+   Values that don't fit the option are refused rather than truncated. */
+int cache_set_option(const char *name, unsigned long long value)
+{
+    size_t i;
+    int found = 0;
+
+    for (i = 0; i < sizeof(cache_settings) / sizeof(cache_settings[0]); i++) {
+        char *field = (char *) &cache + cache_settings[i].offset;
+        if (strcmp(cache_settings[i].name, name))
+            continue;
+        if (cache_settings[i].size == sizeof(unsigned long long)) {
+            __atomic_store_n((unsigned long long *) field, value,
+                             __ATOMIC_RELAXED);
+        } else if (value > UINT_MAX) {
+            return -EINVAL;
+        } else {
+            __atomic_store_n((unsigned *) field, (unsigned) value,
+                             __ATOMIC_RELAXED);
+        }
+        found = 1;
+    }
+    if (!found)
+        return -EINVAL;
+    if (cache.on)
+        cache_evict();
+    return 0;
+}
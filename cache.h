@@ -20,9 +20,7 @@
 #endif
 
 #define DEFAULT_CACHE_TIMEOUT 10
-#define MAX_CACHE_SIZE 10000
-#define MIN_CACHE_CLEAN_INTERVAL 5
-#define CACHE_CLEAN_INTERVAL 60
+#define DEFAULT_CACHE_MAX_ENTRIES 100000
 
 typedef struct fuse_cache_dirhandle *fuse_cache_dirh_t;
 typedef int (*fuse_cache_dirfil_t) (fuse_cache_dirh_t h, const char *name,
@@ -33,12 +31,25 @@ struct fuse_cache_operations {
     int (*cache_getdir) (const char *, fuse_cache_dirh_t, fuse_cache_dirfil_t);
 };
 
+struct cache_stats {
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+    unsigned long entries;
+    unsigned long long bytes;
+};
+
 struct fuse_operations *cache_init(struct fuse_cache_operations *oper);
 int cache_enabled(void);
+unsigned cache_stat_timeout(void);
 void cache_deinit(void);
 int cache_parse_options(struct fuse_args *args);
 void cache_add_attr(const char *path, const struct stat *stbuf);
 void cache_add_dir(const char *path, char **dir);
 void cache_add_link(const char *path, const char *link, size_t size);
+void cache_get_stats(struct cache_stats *stats);
+void cache_forget(const char *path, int subtree);
+int cache_prefetch(const char *path, unsigned depth, const int *stop);
+int cache_set_option(const char *name, unsigned long long value);
 
 #endif   /* __CURLFTPFS_CACHE_H__ */
@@ -13,24 +13,156 @@
 #include <iconv.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
 
 #include "error.h"
 #include "ftpfs.h"
+#include "charset_utils.h"
 
-int convert_charsets(const char* from, const char* to, char** str) {
+/* iconv_open() loads and parses conversion tables, far more work than
+ * converting a file name, so every thread keeps the descriptors it has
+ * opened. There are rarely more than the two directions between the
+ * codepage and the iocharset. */
+#define ICONV_CACHE_SIZE 4
+
+struct iconv_entry {
+  char *from;
+  char *to;
   iconv_t cd;
+  int ascii_safe;   /* ASCII strings come out unchanged */
+};
+
+struct iconv_cache {
+  struct iconv_entry entries[ICONV_CACHE_SIZE];
+  int next;         /* the one to replace when all are used */
+};
+
+static pthread_key_t iconv_key;
+static pthread_once_t iconv_once = PTHREAD_ONCE_INIT;
+
+static void iconv_entry_free(struct iconv_entry *entry) {
+  if (entry->from) {
+    iconv_close(entry->cd);
+    free(entry->from);
+    free(entry->to);
+    entry->from = entry->to = NULL;
+  }
+}
+
+static void iconv_cache_free(void *data) {
+  struct iconv_cache *cache = data;
+  int i;
+
+  for (i = 0; i < ICONV_CACHE_SIZE; i++)
+    iconv_entry_free(&cache->entries[i]);
+  free(cache);
+}
+
+static void iconv_key_create(void) {
+  pthread_key_create(&iconv_key, iconv_cache_free);
+}
+
+/* Whether cd converts every ASCII character to itself, which isn't the case
+ * for UTF-16 or EBCDIC codepages */
+static int iconv_ascii_safe(iconv_t cd) {
+  char in[127];
+  char out[127 * MB_LEN_MAX];
+  ICONV_CONST char *ib = in;
+  char *ob = out;
+  size_t ibl = sizeof(in), obl = sizeof(out);
+  int i;
+
+  for (i = 0; i < 127; i++) in[i] = i + 1;
+  if (iconv(cd, &ib, &ibl, &ob, &obl) == (size_t)-1 ||
+      iconv(cd, NULL, NULL, &ob, &obl) == (size_t)-1)
+    return 0;
+  return ob - out == sizeof(in) && !memcmp(in, out, sizeof(in));
+}
+
+/* This thread's descriptor converting from to to, or NULL if there is none */
+static struct iconv_entry *iconv_get(const char *from, const char *to) {
+  struct iconv_cache *cache;
+  struct iconv_entry *entry;
+  iconv_t cd;
+  int i;
+
+  pthread_once(&iconv_once, iconv_key_create);
+  cache = pthread_getspecific(iconv_key);
+  if (cache == NULL) {
+    cache = calloc(1, sizeof(*cache));
+    if (cache == NULL) return NULL;
+    pthread_setspecific(iconv_key, cache);
+  }
+
+  for (i = 0; i < ICONV_CACHE_SIZE; i++) {
+    entry = &cache->entries[i];
+    if (entry->from && !strcmp(entry->from, from) && !strcmp(entry->to, to)) {
+      /* Back to the initial shift state */
+      iconv(entry->cd, NULL, NULL, NULL, NULL);
+      return entry;
+    }
+  }
+
+  if ((cd = iconv_open(to, from)) == (iconv_t)-1) {
+    DEBUG(2, "iconv_open return error %d\n", errno);
+    return NULL;
+  }
+  entry = &cache->entries[cache->next];
+  cache->next = (cache->next + 1) % ICONV_CACHE_SIZE;
+  iconv_entry_free(entry);
+  entry->from = strdup(from);
+  entry->to = strdup(to);
+  entry->cd = cd;
+  entry->ascii_safe = iconv_ascii_safe(cd);
+  iconv(cd, NULL, NULL, NULL, NULL);
+  return entry;
+}
+
+/* Whether s only has 7-bit characters, checked a word at a time */
+static int is_ascii(const char *s, size_t len) {
+  const uint64_t high = 0x8080808080808080ULL;
+  uint64_t acc = 0;
+  size_t i = 0;
+
+  for (; i + 8 <= len; i += 8) {
+    uint64_t word;
+    memcpy(&word, s + i, 8);
+    acc |= word;
+  }
+  for (; i < len; i++) acc |= (unsigned char)s[i];
+  return !(acc & high);
+}
+
+int charset_passthrough(const char* from, const char* to, const char* s) {
+  struct iconv_entry *entry;
+
+  if (!s || !*s || !to || !from) return 1;
+  if (!is_ascii(s, strlen(s))) return 0;
+  entry = iconv_get(from, to);
+  return entry == NULL || entry->ascii_safe;
+}
+
+int convert_charsets(const char* from, const char* to, char** str) {
+  struct iconv_entry *entry;
   char* s = *str;
+  size_t len;
 
   if (!s || !*s)
     return 0;
 
-  if (to && from && (cd = iconv_open(to, from)) != (iconv_t)-1) {
+  if (to && from && (entry = iconv_get(from, to)) != NULL) {
+    iconv_t cd = entry->cd;
     ICONV_CONST char* ib;
     char* buf;
     char* ob;
     size_t ibl, obl;
 
-    ibl = strlen(s) + 1;
+    len = strlen(s);
+    if (entry->ascii_safe && is_ascii(s, len))
+      return 0;
+
+    ibl = len + 1;
     ib = s;
     obl = MB_LEN_MAX * ibl;
     buf = malloc(obl);
@@ -48,11 +180,8 @@ int convert_charsets(const char* from, const char* to, char** str) {
     } while (ibl && obl);
     *ob = 0;
     DEBUG(2, "iconv return %s\n", buf);
-    iconv_close (cd);
     free(*str);
     *str = buf;
-  } else {
-    DEBUG(2, "iconv_open return error %d\n", errno);
   }
 
   return 0;
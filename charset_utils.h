@@ -2,5 +2,7 @@
 #define __CURLFTPFS_CHARSET_UTILS_H__
 
 int convert_charsets(const char* from, const char* to, char** str);
+/* Returns nonzero if convert_charsets() would leave s as it is */
+int charset_passthrough(const char* from, const char* to, const char* s);
 
 #endif  /* __CURLFTPFS_CHARSET_UTILS_H__ */
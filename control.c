@@ -0,0 +1,301 @@
+/*
+    FTP file system
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include "cache.h"
+#include "error.h"
+#include "ftpfs.h"
+#include "stats.h"
+#include "control.h"
+
+/* A client has this long to send each command */
+#define CONTROL_TIMEOUT 5
+
+/* How many levels below the directory prefetch lists unless told */
+#define CONTROL_PREFETCH_DEPTH 1
+
+static struct {
+  int fd;
+  int wake[2];
+  char *path;
+  pthread_t thread;
+  int running;
+  int stop;               /* interrupts a prefetch in progress */
+} control = { .fd = -1, .wake = { -1, -1 } };
+
+/* The ftpfs options that can be changed while mounted */
+static const struct {
+  const char *name;
+  size_t offset;
+} settings[] = {
+  { "ftpfs_debug",     offsetof(struct ftpfs, debug) },
+  { "list_threads",    offsetof(struct ftpfs, list_threads) },
+  { "connect_timeout", offsetof(struct ftpfs, connect_timeout) },
+};
+
+#define NUM_SETTINGS (sizeof(settings) / sizeof(settings[0]))
+
+static int control_set(const char *name, const char *value) {
+  unsigned long long n;
+  char *end;
+  size_t i;
+
+  errno = 0;
+  n = strtoull(value, &end, 10);
+  if (errno || end == value || *end || value[0] == '-')
+    return -EINVAL;
+
+  if (!strncmp(name, "cache_", 6))
+    return cache_set_option(name, n);
+  if (n > INT_MAX)
+    return -EINVAL;
+
+  for (i = 0; i < NUM_SETTINGS; i++) {
+    if (strcmp(name, settings[i].name))
+      continue;
+    __atomic_store_n((int *) ((char *) &ftpfs + settings[i].offset), (int) n,
+                     __ATOMIC_RELAXED);
+    /* Upload connections pick it up when they are made, the main one has to
+       be told */
+    if (settings[i].offset == offsetof(struct ftpfs, connect_timeout) &&
+        ftpfs.connection) {
+      pthread_mutex_lock(&ftpfs.lock);
+      curl_easy_setopt(ftpfs.connection, CURLOPT_CONNECTTIMEOUT, (long) n);
+      pthread_mutex_unlock(&ftpfs.lock);
+    }
+    return 0;
+  }
+  return -EINVAL;
+}
+
+/* Checks that path is absolute and drops its trailing slashes */
+static int control_path(char *path) {
+  size_t len = strlen(path);
+
+  if (path[0] != '/')
+    return -EINVAL;
+  while (len > 1 && path[len - 1] == '/')
+    path[--len] = '\0';
+  return 0;
+}
+
+/* Runs the command in line and appends its answer to reply */
+static void control_run(char *line, GString *reply) {
+  char *arg = strchr(line, ' ');
+  int res = 0;
+
+  if (arg)
+    *arg++ = '\0';
+
+  if (!strcmp(line, "invalidate") || !strcmp(line, "invalidate-tree")) {
+    int subtree = !strcmp(line, "invalidate-tree");
+    res = arg ? control_path(arg) : -EINVAL;
+    if (!res)
+      cache_forget(arg, subtree);
+  } else if (!strcmp(line, "prefetch")) {
+    unsigned depth = CONTROL_PREFETCH_DEPTH;
+    if (arg && arg[0] >= '0' && arg[0] <= '9') {
+      depth = strtoul(arg, &arg, 10);
+      arg = *arg == ' ' ? arg + 1 : NULL;
+    }
+    res = arg ? control_path(arg) : -EINVAL;
+    if (!res) {
+      res = cache_prefetch(arg, depth, &control.stop);
+      if (res >= 0) {
+        g_string_append_printf(reply, "ok %d\n", res);
+        return;
+      }
+    }
+  } else if (!strcmp(line, "set")) {
+    char *value = arg ? strchr(arg, ' ') : NULL;
+    if (value) {
+      *value++ = '\0';
+      res = control_set(arg, value);
+    } else {
+      res = -EINVAL;
+    }
+  } else if (!strcmp(line, "stats") || !strcmp(line, "latency")) {
+    char *text = line[0] == 's' ? stats_format() : stats_format_latency();
+    g_string_append(reply, text);
+    g_free(text);
+  } else {
+    g_string_append_printf(reply, "error: unknown command %s\n", line);
+    return;
+  }
+
+  if (res < 0)
+    g_string_append_printf(reply, "error: %s\n", strerror(-res));
+  else
+    g_string_append(reply, "ok\n");
+}
+
+static void control_write(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return;
+    }
+    buf += n;
+    len -= n;
+  }
+}
+
+/* Answers the commands of one client until it hangs up */
+static void control_serve(int fd) {
+  struct timeval tv = { CONTROL_TIMEOUT, 0 };
+  char line[PATH_MAX + 64];
+  GString *reply = g_string_new("");
+  FILE *in;
+
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  in = fdopen(fd, "r");
+  if (in == NULL) {
+    close(fd);
+    g_string_free(reply, TRUE);
+    return;
+  }
+
+  while (fgets(line, sizeof(line), in)) {
+    size_t len = strlen(line);
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+      line[--len] = '\0';
+    if (len == 0)
+      continue;
+
+    DEBUG(1, "control: %s\n", line);
+    g_string_truncate(reply, 0);
+    control_run(line, reply);
+    control_write(fd, reply->str, reply->len);
+  }
+
+  fclose(in);
+  g_string_free(reply, TRUE);
+}
+
+static void *control_thread(void *arg) {
+  struct pollfd fds[2];
+
+  (void) arg;
+
+  fds[0].fd = control.fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = control.wake[0];
+  fds[1].events = POLLIN;
+
+  for (;;) {
+    int fd;
+
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    if (fds[1].revents)
+      break;
+    fd = accept(control.fd, NULL, NULL);
+    if (fd >= 0)
+      control_serve(fd);
+  }
+  return NULL;
+}
+
+int control_start(const char *path) {
+  struct sockaddr_un addr;
+  struct stat st;
+  mode_t mask;
+  int fd, err;
+
+  if (strlen(path) >= sizeof(addr.sun_path))
+    return -ENAMETOOLONG;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  /* A socket left behind by a previous mount that nobody answers on anymore
+     is replaced. Anything else in the way is left alone. */
+  if (lstat(path, &st) == 0) {
+    if (!S_ISSOCK(st.st_mode))
+      return -EEXIST;
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+      return -errno;
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+      close(fd);
+      return -EADDRINUSE;
+    }
+    err = errno;
+    close(fd);
+    if (err != ECONNREFUSED)
+      return -EEXIST;
+    unlink(path);
+  }
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -errno;
+  /* Only the user who mounted may send commands */
+  mask = umask(077);
+  if (bind(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+    err = -errno;
+    umask(mask);
+    close(fd);
+    return err;
+  }
+  umask(mask);
+  if (listen(fd, 8) || pipe(control.wake)) {
+    err = -errno;
+    close(fd);
+    unlink(path);
+    return err;
+  }
+
+  control.fd = fd;
+  control.path = strdup(path);
+  control.stop = 0;
+  err = pthread_create(&control.thread, NULL, control_thread, NULL);
+  if (err) {
+    control_stop();
+    return -err;
+  }
+  control.running = 1;
+  return 0;
+}
+
+void control_stop(void) {
+  if (control.fd < 0)
+    return;
+
+  if (control.running) {
+    __atomic_store_n(&control.stop, 1, __ATOMIC_RELAXED);
+    control_write(control.wake[1], "", 1);
+    pthread_join(control.thread, NULL);
+    control.running = 0;
+  }
+  close(control.wake[0]);
+  close(control.wake[1]);
+  close(control.fd);
+  control.fd = -1;
+  unlink(control.path);
+  free(control.path);
+  control.path = NULL;
+}
@@ -0,0 +1,33 @@
+#ifndef __CURLFTPFS_CONTROL_H__
+#define __CURLFTPFS_CONTROL_H__ 1
+
+/*
+    FTP file system
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+/* A Unix domain socket taking one command per line, to act on the mounted
+   filesystem without remounting it:
+
+     invalidate PATH           forget what is cached about PATH
+     invalidate-tree PATH      same for PATH and everything below it
+     prefetch [DEPTH] PATH     list PATH and the directories below it, down
+                               to DEPTH levels, by default 1
+     set NAME VALUE            change a cache_* option, ftpfs_debug,
+                               list_threads or connect_timeout
+     stats                     the content of .curlftpfs/stats
+     latency                   the content of .curlftpfs/latency
+
+   Each command is answered by its output, if any, then a line saying "ok",
+   optionally followed by a count, or "error: " and the reason. */
+
+/* Starts serving the socket at path from a thread of its own. Returns 0 or
+   -errno. */
+int control_start(const char *path);
+
+/* Stops serving the socket and removes it */
+void control_stop(void);
+
+#endif
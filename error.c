@@ -6,24 +6,356 @@
     See the file COPYING.
 */
 
-#include <stdarg.h> /* <va_list>, va_*() */
-#include <stdio.h>  /* stderr, fprintf(), vfprintf() */
-#include <time.h>   /* time() */
+#include <errno.h>   /* errno, EINTR */
+#include <pthread.h> /* pthread_*() */
+#include <signal.h>  /* sigaction(), SIGUSR1, SIGUSR2 */
+#include <stdarg.h>  /* <va_list>, va_*() */
+#include <stdio.h>   /* stderr, fprintf(), snprintf(), vsnprintf() */
+#include <stdlib.h>  /* atexit(), calloc(), free() */
+#include <string.h>  /* memcpy(), memset(), strerror() */
+#include <time.h>    /* time(), clock_gettime() */
+#include <unistd.h>  /* write(), STDERR_FILENO */
 
 #include "error.h"
 
+/* Bytes of messages a thread can have waiting, a power of two */
+#define LOG_RING_SIZE 65536
+
+/* Longer messages are cut */
+#define LOG_LINE_MAX 1024
+
+/* How often the background thread writes the rings out */
+#define LOG_FLUSH_MS 100
+
+/* An error message is written at most LOG_BURST times every LOG_WINDOW
+   seconds */
+#define LOG_BURST 5
+#define LOG_WINDOW 10
+#define LOG_LIMITS 64
+
+struct log_ring {
+  char buf[LOG_RING_SIZE];
+  unsigned long head;     /* advanced by the thread owning the ring */
+  unsigned long tail;     /* advanced by the background thread */
+  unsigned long dropped;  /* messages that did not fit */
+  unsigned long reported; /* dropped messages already told about */
+  int dead;               /* the owner has exited */
+  struct log_ring *next;
+};
+
+struct log_limit {
+  unsigned int hash;
+  time_t start;
+  unsigned int count;
+  unsigned long suppressed;
+};
+
+static struct {
+  int running;
+  int stop;
+  int *level;
+  time_t now;
+  pthread_t thread;
+  pthread_mutex_t lock;   /* protects rings and stop */
+  pthread_cond_t cond;
+  pthread_once_t once;
+  pthread_key_t key;
+  struct log_ring *rings;
+  pthread_mutex_t limits_lock;
+  struct log_limit limits[LOG_LIMITS];
+} logger = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .cond = PTHREAD_COND_INITIALIZER,
+  .once = PTHREAD_ONCE_INIT,
+  .limits_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void write_all(const char *buf, size_t len)
+{
+  while (len > 0) {
+    ssize_t n = write(STDERR_FILENO, buf, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return;
+    }
+    buf += n;
+    len -= n;
+  }
+}
+
+/* The background thread refreshes the clock, so that logging a message does
+   not cost a time() call */
+static time_t log_time(void)
+{
+  if (__atomic_load_n(&logger.running, __ATOMIC_ACQUIRE))
+    return __atomic_load_n(&logger.now, __ATOMIC_RELAXED);
+  return time(NULL);
+}
+
+/* Returns the length of a message snprintf() formatted into a buffer of size
+   bytes, making it end its line if it had to be cut */
+static size_t log_length(char *msg, int len, size_t size)
+{
+  if (len < 0)
+    return 0;
+  if ((size_t) len >= size) {
+    len = size - 1;
+    msg[len - 1] = '\n';
+  }
+  return len;
+}
+
+static void log_ring_release(void *ring_)
+{
+  struct log_ring *ring = (struct log_ring *) ring_;
+  __atomic_store_n(&ring->dead, 1, __ATOMIC_RELEASE);
+}
+
+static void log_key_create(void)
+{
+  pthread_key_create(&logger.key, log_ring_release);
+  /* Do not lose what is still in the rings when exiting on a fatal error */
+  atexit(ftpfs_log_stop);
+}
+
+static struct log_ring *log_ring_get(void)
+{
+  struct log_ring *ring = pthread_getspecific(logger.key);
+
+  if (ring == NULL) {
+    ring = calloc(1, sizeof(*ring));
+    if (ring == NULL)
+      return NULL;
+    pthread_setspecific(logger.key, ring);
+    pthread_mutex_lock(&logger.lock);
+    ring->next = logger.rings;
+    logger.rings = ring;
+    pthread_mutex_unlock(&logger.lock);
+  }
+  return ring;
+}
+
+static void log_write(const char *msg, size_t len)
+{
+  struct log_ring *ring;
+  unsigned long head, tail;
+  size_t off, first;
+
+  if (!__atomic_load_n(&logger.running, __ATOMIC_ACQUIRE) ||
+      (ring = log_ring_get()) == NULL) {
+    write_all(msg, len);
+    return;
+  }
+
+  head = ring->head;
+  tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  if (head - tail + len > LOG_RING_SIZE) {
+    __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&logger.cond);
+    return;
+  }
+
+  off = head & (LOG_RING_SIZE - 1);
+  first = LOG_RING_SIZE - off < len ? LOG_RING_SIZE - off : len;
+  memcpy(ring->buf + off, msg, first);
+  memcpy(ring->buf, msg + first, len - first);
+  __atomic_store_n(&ring->head, head + len, __ATOMIC_RELEASE);
+
+  /* Do not wait for the next round if the ring is filling up */
+  if (head + len - tail > LOG_RING_SIZE / 2)
+    pthread_cond_signal(&logger.cond);
+}
+
+/* Writes out every ring and frees those of threads that have exited. Called
+   with logger.lock held. */
+static void log_drain(void)
+{
+  struct log_ring **link = &logger.rings;
+  struct log_ring *ring;
+
+  while ((ring = *link) != NULL) {
+    int dead = __atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE);
+    unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    unsigned long tail = ring->tail;
+    unsigned long dropped;
+
+    while (tail != head) {
+      size_t off = tail & (LOG_RING_SIZE - 1);
+      size_t len = head - tail < LOG_RING_SIZE - off ? head - tail
+                                                     : LOG_RING_SIZE - off;
+      write_all(ring->buf + off, len);
+      tail += len;
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+    dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    if (dropped != ring->reported) {
+      char msg[64];
+      int n = snprintf(msg, sizeof(msg), "ftpfs: %lu log messages dropped\n",
+                       dropped - ring->reported);
+      write_all(msg, log_length(msg, n, sizeof(msg)));
+      ring->reported = dropped;
+    }
+
+    if (dead) {
+      *link = ring->next;
+      free(ring);
+    } else {
+      link = &ring->next;
+    }
+  }
+}
+
+static void *log_flusher(void *arg)
+{
+  (void) arg;
+
+  pthread_mutex_lock(&logger.lock);
+  while (!logger.stop) {
+    struct timespec ts;
+
+    log_drain();
+    __atomic_store_n(&logger.now, time(NULL), __ATOMIC_RELAXED);
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += LOG_FLUSH_MS * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&logger.cond, &logger.lock, &ts);
+  }
+  log_drain();
+  pthread_mutex_unlock(&logger.lock);
+
+  return NULL;
+}
+
+static void log_level_signal(int sig)
+{
+  int level = __atomic_load_n(logger.level, __ATOMIC_RELAXED);
+
+  if (sig == SIGUSR1)
+    level++;
+  else if (level > 0)
+    level--;
+  __atomic_store_n(logger.level, level, __ATOMIC_RELAXED);
+}
+
+void ftpfs_log_start(int *level) {
+  struct sigaction sa;
+  int err;
+
+  if (__atomic_load_n(&logger.running, __ATOMIC_ACQUIRE))
+    return;
+
+  pthread_once(&logger.once, log_key_create);
+  logger.now = time(NULL);
+  err = pthread_create(&logger.thread, NULL, log_flusher, NULL);
+  if (err) {
+    fprintf(stderr, "failed to create log thread: %s\n", strerror(err));
+    return;
+  }
+  __atomic_store_n(&logger.running, 1, __ATOMIC_RELEASE);
+
+  if (level) {
+    logger.level = level;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = log_level_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+    sigaction(SIGUSR2, &sa, NULL);
+  }
+}
+
+void ftpfs_log_stop(void) {
+  if (!__atomic_load_n(&logger.running, __ATOMIC_ACQUIRE))
+    return;
+
+  __atomic_store_n(&logger.running, 0, __ATOMIC_RELEASE);
+  pthread_mutex_lock(&logger.lock);
+  logger.stop = 1;
+  pthread_cond_signal(&logger.cond);
+  pthread_mutex_unlock(&logger.lock);
+  pthread_join(logger.thread, NULL);
+  logger.stop = 0;
+}
+
 void ftpfs_debug_printf(unsigned int indent, const char *file, int line, const char *fmt, ...) {
+  char msg[LOG_LINE_MAX];
+  size_t len;
   va_list ap;
 
-  while (indent > 0) {
-    fprintf(stderr, " ");
-    indent--;
+  if (indent > 16)
+    indent = 16;
+  memset(msg, ' ', indent);
+  len = indent + log_length(msg + indent,
+                            snprintf(msg + indent, sizeof(msg) - indent,
+                                     "%ld %s:%d ", (long) log_time(),
+                                     file, line),
+                            sizeof(msg) - indent);
+
+  va_start(ap, fmt);
+  len = log_length(msg, len + vsnprintf(msg + len, sizeof(msg) - len, fmt, ap),
+                   sizeof(msg));
+  va_end(ap);
+
+  log_write(msg, len);
+}
+
+/* Tells whether a message may be written, and how many like those sharing
+   its slot were held back since the last one was */
+static int log_allow(const char *msg, size_t len, unsigned long *suppressed)
+{
+  struct log_limit *limit;
+  unsigned int hash = 2166136261u;
+  time_t now = log_time();
+  size_t i;
+  int allow;
+
+  for (i = 0; i < len; i++)
+    hash = (hash ^ (unsigned char) msg[i]) * 16777619u;
+  limit = &logger.limits[hash % LOG_LIMITS];
+
+  pthread_mutex_lock(&logger.limits_lock);
+  *suppressed = 0;
+  if (limit->hash != hash || now - limit->start >= LOG_WINDOW) {
+    *suppressed = limit->suppressed;
+    limit->hash = hash;
+    limit->start = now;
+    limit->count = 0;
+    limit->suppressed = 0;
   }
+  allow = limit->count < LOG_BURST;
+  if (allow)
+    limit->count++;
+  else
+    limit->suppressed++;
+  pthread_mutex_unlock(&logger.limits_lock);
+
+  return allow;
+}
+
+void ftpfs_error(const char *fmt, ...) {
+  char msg[LOG_LINE_MAX];
+  unsigned long suppressed;
+  size_t len;
+  va_list ap;
 
-  fprintf(stderr, "%ld %s:%d ", time(NULL), file, line);
   va_start(ap, fmt);
-  vfprintf(stderr, fmt, ap);
+  len = log_length(msg, vsnprintf(msg, sizeof(msg), fmt, ap), sizeof(msg));
   va_end(ap);
 
-  return;
+  if (!log_allow(msg, len, &suppressed))
+    return;
+
+  if (suppressed) {
+    char note[64];
+    int n = snprintf(note, sizeof(note),
+                     "ftpfs: %lu repeated messages suppressed\n", suppressed);
+    log_write(note, log_length(note, n, sizeof(note)));
+  }
+  log_write(msg, len);
 }
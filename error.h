@@ -9,8 +9,25 @@
     See the file COPYING.
 */
 
+/* Messages are written to stderr as they come until ftpfs_log_start() is
+   called. From then on each thread appends them to a ring of its own and a
+   background thread writes them out, so that logging never waits on stderr
+   nor on other threads. */
+
 void ftpfs_debug_printf(unsigned int indent, const char *file, int line, const char *fmt, ...);
 
+/* Logs an error. Identical messages are only written a few times in a row,
+   and how many were left out is told when they show up again. */
+void ftpfs_error(const char *fmt, ...);
+
+/* Starts the background writer. The debug level pointed to by level is
+   raised by SIGUSR1 and lowered by SIGUSR2. Must be called after the process
+   has daemonized, threads do not survive fork(). */
+void ftpfs_log_start(int *level);
+
+/* Writes out what is left in the rings and goes back to writing directly */
+void ftpfs_log_stop(void);
+
 #define DEBUG(level, ...) \
   do { \
     if (level <= ftpfs.debug) \
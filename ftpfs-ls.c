@@ -19,9 +19,12 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
 #include <glib.h>
 
 #include "error.h"
+#include "probes.h"
 #include "ftpfs.h"
 #include "charset_utils.h"
 #include "ftpfs-ls.h"
@@ -33,74 +36,205 @@ struct cache {
 
 extern struct cache cache;
 
-static int parse_dir_unix(const char *line,
+/* The parsers below tokenize a line in place instead of going through
+ * sscanf(), but accept exactly what the sscanf() formats they replace did.
+ * Tokens point into the line, which is always NUL terminated. */
+struct token {
+  char *p;
+  size_t len;
+};
+
+static inline int is_space(char c) {
+  return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+static inline int is_blank(char c) {
+  return c == ' ' || c == '\t';
+}
+
+/* "%<width>s": skips white space and takes up to width other characters */
+static int scan_word(char **s, size_t width, struct token *tok) {
+  char *p = *s;
+
+  while (is_space(*p)) p++;
+  tok->p = p;
+  while (*p && !is_space(*p) && (size_t)(p - tok->p) < width) p++;
+  tok->len = p - tok->p;
+  *s = p;
+  return tok->len > 0;
+}
+
+/* "%*[ \t]" */
+static int scan_blanks(char **s) {
+  char *p = *s;
+
+  while (is_blank(*p)) p++;
+  if (p == *s) return 0;
+  *s = p;
+  return 1;
+}
+
+/* "%llu", only written to n if there is a number */
+static int scan_number(char **s, unsigned long long *n) {
+  char *p = *s;
+  unsigned long long v = 0;
+  int negative = 0;
+
+  while (is_space(*p)) p++;
+  if (*p == '+' || *p == '-') negative = *p++ == '-';
+  if (*p < '0' || *p > '9') return 0;
+  while (*p >= '0' && *p <= '9') v = v * 10 + (*p++ - '0');
+  *n = negative ? -v : v;
+  *s = p;
+  return 1;
+}
+
+/* Reads a number between min and max the way strptime() does: at most
+ * max_digits digits, and no more of them than keep it below max */
+static int token_int(const char **s, const char *end,
+                     int max_digits, int min, int max, int *v) {
+  const char *p = *s;
+  int n = 0;
+
+  while (p < end && is_space(*p)) p++;
+  if (p == end || *p < '0' || *p > '9') return 0;
+  do {
+    n = n * 10 + (*p++ - '0');
+  } while (--max_digits > 0 && n * 10 <= max &&
+           p < end && *p >= '0' && *p <= '9');
+  if (n < min || n > max) return 0;
+  *v = n;
+  *s = p;
+  return 1;
+}
+
+static int token_month(const struct token *tok) {
+  static const char months[] = "janfebmaraprmayjunjulaugsepoctnovdec";
+  char m[3];
+  int i;
+
+  if (tok->len != 3) return -1;
+  for (i = 0; i < 3; i++) m[i] = tok->p[i] | 0x20;
+  for (i = 0; i < 12; i++) {
+    if (!memcmp(months + 3 * i, m, 3)) return i;
+  }
+  return -1;
+}
+
+/* The unix date is "<month> <day> <year>" or "<month> <day> <HH:MM>" */
+static void unix_date(const struct token *month, const struct token *day,
+                      const struct token *year, struct tm *tm) {
+  const char *p = year->p;
+  const char *end = year->p + year->len;
+  int v, mon;
+
+  if (memchr(year->p, ':', year->len)) {
+    if (!token_int(&p, end, 2, 0, 23, &v)) return;
+    tm->tm_hour = v;
+    if (p == end || *p++ != ':' || !token_int(&p, end, 2, 0, 59, &v)) return;
+    tm->tm_min = v;
+  } else {
+    if (!token_int(&p, end, 4, 0, 9999, &v)) return;
+    tm->tm_year = v - 1900;
+  }
+  if (p != end) return;
+  if ((mon = token_month(month)) < 0) return;
+  tm->tm_mon = mon;
+  p = day->p;
+  if (token_int(&p, day->p + day->len, 2, 1, 31, &v)) tm->tm_mday = v;
+}
+
+/* mktime() of the fields the parsers set, memoized per listing */
+static time_t list_mktime(struct list_parser *parser, struct tm *tm) {
+  uint64_t key = ((uint64_t)(unsigned)tm->tm_year << 32) |
+                 ((uint64_t)(tm->tm_mon & 0xff) << 24) |
+                 ((tm->tm_mday & 0xff) << 16) | ((tm->tm_hour & 0xff) << 8) |
+                 (tm->tm_min & 0xff) | (1ULL << 63);
+  unsigned slot = (key * 0x9e3779b97f4a7c15ULL) >> 58;
+
+  if (parser->dates[slot].key != key) {
+    parser->dates[slot].key = key;
+    parser->dates[slot].mtime = mktime(tm);
+  }
+  return parser->dates[slot].mtime;
+}
+
+static time_t unix_mtime(struct list_parser *parser, const struct token *month,
+                         const struct token *day, const struct token *year) {
+  struct tm tm = parser->now;
+
+  if (memchr(year->p, ':', year->len)) {
+    unix_date(month, day, year, &tm);
+    /* Unix systems omit the year for the last six months */
+    if (parser->now.tm_mon + 5 < tm.tm_mon) {  /* month from last year */
+      DEBUG(2, "correct year: cur_mon: %d, file_mon: %d\n",
+            parser->now.tm_mon, tm.tm_mon);
+      tm.tm_year--;  /* correct the year */
+    }
+  } else {
+    unix_date(month, day, year, &tm);
+  }
+
+  return list_mktime(parser, &tm);
+}
+
+static int parse_dir_unix(struct list_parser *parser,
+                          char *line,
                           struct stat *sbuf,
-                          char *file,
-                          char *link) {
-  char mode[12];
-  long nlink = 1;
-  char user[33];
-  char group[33];
+                          char **file,
+                          char **link) {
+  struct token mode, user, group, month, day, year;
+  unsigned long long nlink = 1;
   unsigned long long size;
-  char month[4];
-  char day[3];
-  char year[6];
   char *link_marker;
+  char *s;
+  size_t len;
   int i;
-  char date[20];
-  struct tm tm;
-  time_t tt;
-  int res;
-
-  memset(file, 0, sizeof(char)*1024);
-  memset(&tm, 0, sizeof(tm));
-  memset(&tt, 0, sizeof(tt));
-
-#define SPACES "%*[ \t]"
-  res = sscanf(line,
-               "%11s"
-               "%ld"  SPACES
-               "%32s" SPACES
-               "%32s" SPACES
-               "%llu" SPACES
-               "%3s"  SPACES
-               "%2s"  SPACES
-               "%5s"  "%*c"
-               "%1023c",
-               mode, &nlink, user, group, &size, month, day, year, file);
-  if (res < 9) {
-    res = sscanf(line,
-                 "%11s"
-                 "%32s" SPACES
-                 "%32s" SPACES
-                 "%llu" SPACES
-                 "%3s"  SPACES
-                 "%2s"  SPACES
-                 "%5s"  "%*c"
-                 "%1023c",
-                 mode, user, group, &size, month, day, year, file);
-    if (res < 8) {
+
+  /* Some servers leave the link count out */
+  s = line;
+  if (!(scan_word(&s, 11, &mode) && scan_number(&s, &nlink) &&
+        scan_blanks(&s) && scan_word(&s, 32, &user) && scan_blanks(&s) &&
+        scan_word(&s, 32, &group) && scan_blanks(&s) &&
+        scan_number(&s, &size) && scan_blanks(&s) &&
+        scan_word(&s, 3, &month) && scan_blanks(&s) &&
+        scan_word(&s, 2, &day) && scan_blanks(&s) &&
+        scan_word(&s, 5, &year) && s[0] && s[1])) {
+    s = line;
+    if (!(scan_word(&s, 11, &mode) &&
+          scan_word(&s, 32, &user) && scan_blanks(&s) &&
+          scan_word(&s, 32, &group) && scan_blanks(&s) &&
+          scan_number(&s, &size) && scan_blanks(&s) &&
+          scan_word(&s, 3, &month) && scan_blanks(&s) &&
+          scan_word(&s, 2, &day) && scan_blanks(&s) &&
+          scan_word(&s, 5, &year) && s[0] && s[1])) {
       return 0;
     }
   }
-#undef SPACES
+  /* Anything shorter is not a mode, but maybe a NetWare type and rights */
+  if (mode.len < 10) return 0;
 
-  link_marker = strstr(file, " -> ");
+  /* The name starts after the single separator following the date */
+  *file = s + 1;
+  len = strlen(*file);
+  if (len > 1023) (*file)[1023] = '\0';
+
+  link_marker = strstr(*file, " -> ");
   if (link_marker) {
-    strcpy(link, link_marker + 4);
+    *link = link_marker + 4;
     *link_marker = '\0';
   }
 
   i = 0;
-  if (mode[i] == 'd') {
+  if (mode.p[i] == 'd') {
     sbuf->st_mode |= S_IFDIR;
-  } else if (mode[i] == 'l') {
+  } else if (mode.p[i] == 'l') {
     sbuf->st_mode |= S_IFLNK;
   } else {
     sbuf->st_mode |= S_IFREG;
   }
   for (i = 1; i < 10; ++i) {
-    if (mode[i] != '-') {
+    if (mode.p[i] != '-') {
       sbuf->st_mode |= 1 << (9 - i);
     }
   }
@@ -117,65 +251,71 @@ static int parse_dir_unix(const char *line,
       ((size + ftpfs.blksize - 1) & ~((unsigned long long) ftpfs.blksize - 1)) >> 9;
   }
 
-  sprintf(date,"%s,%s,%s", year, month, day);
-  tt = time(NULL);
-  gmtime_r(&tt, &tm);
-  tm.tm_sec = tm.tm_min = tm.tm_hour = 0;
-  if(strchr(year, ':')) {
-    int cur_mon = tm.tm_mon;  /* save current month */
-    strptime(date, "%H:%M,%b,%d", &tm);
-    /* Unix systems omit the year for the last six months */
-    if (cur_mon + 5 < tm.tm_mon) {  /* month from last year */
-      DEBUG(2, "correct year: cur_mon: %d, file_mon: %d\n", cur_mon, tm.tm_mon);
-      tm.tm_year--;  /* correct the year */
+  sbuf->st_atime = sbuf->st_ctime = sbuf->st_mtime =
+    unix_mtime(parser, &month, &day, &year);
+
+  return 1;
+}
+
+/* The windows date is "MM-DD-YY  HH:MM(AM|PM)" */
+static void win_date(const struct token *date, const struct token *hour,
+                     struct tm *tm) {
+  const char *p = date->p;
+  const char *end = date->p + date->len;
+  int v;
+
+  if (token_int(&p, end, 2, 1, 12, &v)) {
+    tm->tm_mon = v - 1;
+    if (p < end && *p++ == '-' && token_int(&p, end, 2, 1, 31, &v)) {
+      tm->tm_mday = v;
+      if (p < end && *p++ == '-' && token_int(&p, end, 2, 0, 99, &v))
+        tm->tm_year = v < 69 ? v + 100 : v;
     }
-  } else {
-    strptime(date, "%Y,%b,%d", &tm);
   }
 
-  sbuf->st_atime = sbuf->st_ctime = sbuf->st_mtime = mktime(&tm);
-
-  return 1;
+  p = hour->p;
+  end = hour->p + hour->len;
+  if (!token_int(&p, end, 2, 1, 12, &v)) return;
+  tm->tm_hour = v % 12;
+  if (p == end || *p++ != ':' || !token_int(&p, end, 2, 0, 59, &v)) return;
+  tm->tm_min = v;
+  if (end - p >= 2 && (p[1] | 0x20) == 'm' && (p[0] | 0x20) == 'p')
+    tm->tm_hour += 12;
 }
 
-static int parse_dir_win(const char *line,
+static int parse_dir_win(struct list_parser *parser,
+                         char *line,
                          struct stat *sbuf,
-                         char *file,
-                         char *link) {
-  char date[9];
-  char hour[8];
-  char size[33];
-  struct tm tm;
-  time_t tt;
-  int res;
+                         char **file,
+                         char **link) {
+  struct token date, hour, size;
+  char *s = line;
+  struct tm tm = parser->now;
   (void)link;
 
-  memset(file, 0, sizeof(char)*1024);
-  memset(&tm, 0, sizeof(tm));
-  memset(&tt, 0, sizeof(tt));
-
-  res = sscanf(line, "%8s%*[ \t]%7s%*[ \t]%32s%*[ \t]%1023c",
-               date, hour, size, file);
-  if (res < 4) {
+  if (!(scan_word(&s, 8, &date) && scan_blanks(&s) &&
+        scan_word(&s, 7, &hour) && scan_blanks(&s) &&
+        scan_word(&s, 32, &size) && scan_blanks(&s) && *s)) {
     return 0;
   }
+  /* Every token is followed by blanks, so they can be terminated now */
+  *file = s;
+  if (strlen(s) > 1023) s[1023] = '\0';
+  size.p[size.len] = '\0';
 
-  DEBUG(2, "date: %s hour: %s size: %s file: %s\n", date, hour, size, file);
+  DEBUG(2, "date: %.*s hour: %.*s size: %s file: %s\n",
+        (int)date.len, date.p, (int)hour.len, hour.p, size.p, *file);
 
-  tt = time(NULL);
-  gmtime_r(&tt, &tm);
-  tm.tm_sec = tm.tm_min = tm.tm_hour = 0;
-  strptime(date, "%m-%d-%y", &tm);
-  strptime(hour, "%I:%M%p", &tm);
+  win_date(&date, &hour, &tm);
 
-  sbuf->st_atime = sbuf->st_ctime = sbuf->st_mtime = mktime(&tm);
+  sbuf->st_atime = sbuf->st_ctime = sbuf->st_mtime = list_mktime(parser, &tm);
 
   sbuf->st_nlink = 1;
 
-  if (!strcmp(size, "<DIR>")) {
+  if (!strcmp(size.p, "<DIR>")) {
     sbuf->st_mode |= S_IFDIR;
   } else {
-    unsigned long long nsize = strtoull(size, NULL, 0);
+    unsigned long long nsize = strtoull(size.p, NULL, 0);
     sbuf->st_mode |= S_IFREG;
     sbuf->st_size = nsize;
     if (ftpfs.blksize) {
@@ -188,28 +328,174 @@ static int parse_dir_win(const char *line,
   return 1;
 }
 
-static int parse_dir_netware(const char *line,
+/* NetWare lists "<d|-> [RWCEAFMS] <owner> <size> <month> <day> <year|time>
+ * <name>", with the trustee rights of the user instead of a unix mode */
+static int parse_dir_netware(struct list_parser *parser,
+                             char *line,
                              struct stat *sbuf,
-                             char *file,
-                             char *link) {
-  (void) line;
-  (void) sbuf;
-  (void) file;
-  (void) link;
-  return 0;
+                             char **file,
+                             char **link) {
+  struct token type, rights, owner, month, day, year;
+  unsigned long long size;
+  char *s = line;
+  size_t i;
+  (void)link;
+
+  if (!(scan_word(&s, 1, &type) && (type.p[0] == 'd' || type.p[0] == '-') &&
+        scan_blanks(&s) && scan_word(&s, 10, &rights) &&
+        rights.p[0] == '[' && rights.p[rights.len - 1] == ']' &&
+        scan_blanks(&s) && scan_word(&s, 32, &owner) && scan_blanks(&s) &&
+        scan_number(&s, &size) && scan_blanks(&s) &&
+        scan_word(&s, 3, &month) && scan_blanks(&s) &&
+        scan_word(&s, 2, &day) && scan_blanks(&s) &&
+        scan_word(&s, 5, &year) && s[0] && s[1])) {
+    return 0;
+  }
+
+  *file = s + 1;
+  if (strlen(*file) > 1023) (*file)[1023] = '\0';
+
+  sbuf->st_mode |= type.p[0] == 'd' ? S_IFDIR : S_IFREG;
+  for (i = 1; i < rights.len - 1; i++) {
+    switch (rights.p[i]) {
+      case 'R': sbuf->st_mode |= S_IRUSR | S_IRGRP | S_IROTH; break;
+      case 'W': sbuf->st_mode |= S_IWUSR; break;
+      case 'F':
+        if (type.p[0] == 'd') sbuf->st_mode |= S_IXUSR | S_IXGRP | S_IXOTH;
+        break;
+    }
+  }
+
+  sbuf->st_nlink = 1;
+
+  sbuf->st_size = size;
+  if (ftpfs.blksize) {
+    sbuf->st_blksize = ftpfs.blksize;
+    sbuf->st_blocks =
+      ((size + ftpfs.blksize - 1) & ~((unsigned long long) ftpfs.blksize - 1)) >> 9;
+  }
+
+  sbuf->st_atime = sbuf->st_ctime = sbuf->st_mtime =
+    unix_mtime(parser, &month, &day, &year);
+
+  return 1;
 }
 
+struct list_dialect {
+  int id;
+  const char *name;
+  int (*parse)(struct list_parser *parser, char *line, struct stat *sbuf,
+               char **file, char **link);
+};
 
-int parse_dir(const char* list, const char* dir,
-              const char* name, struct stat* sbuf,
-              char* linkbuf, int linklen,
-              fuse_cache_dirh_t h, fuse_cache_dirfil_t filler) {
+/* In the order they are tried. NetWare lines would also pass for unix ones
+ * with an odd mode, so that parser goes first; it gives up on the second
+ * character of anything else. */
+static const struct list_dialect dialects[] = {
+  { LIST_DIALECT_NETWARE, "netware", parse_dir_netware },
+  { LIST_DIALECT_UNIX,    "unix",    parse_dir_unix },
+  { LIST_DIALECT_DOS,     "dos",     parse_dir_win },
+};
+
+#define NUM_DIALECTS (sizeof(dialects) / sizeof(dialects[0]))
+
+/* The dialect the server was last seen to use, tried before the others.
+ * The listing threads share it. */
+static const struct list_dialect *detected;
+
+static const struct list_dialect *find_dialect(int id) {
+  size_t i;
+
+  for (i = 0; i < NUM_DIALECTS; i++) {
+    if (dialects[i].id == id) return &dialects[i];
+  }
+  return NULL;
+}
+
+static int parse_entry(struct list_parser *parser, char *line,
+                       struct stat *sbuf, char **file, char **link) {
+  const struct list_dialect *dialect =
+    __atomic_load_n(&detected, __ATOMIC_RELAXED);
+  size_t i;
+
+  if (ftpfs.list_dialect != LIST_DIALECT_AUTO) {
+    dialect = find_dialect(ftpfs.list_dialect);
+    return dialect && dialect->parse(parser, line, sbuf, file, link);
+  }
+
+  if (dialect && dialect->parse(parser, line, sbuf, file, link)) return 1;
+
+  /* Header lines like "total 42" get here on every listing, so they cost
+   * a pass through all the dialects; entries only do before detection or
+   * when the server changes its mind */
+  for (i = 0; i < NUM_DIALECTS; i++) {
+    if (&dialects[i] == dialect) continue;
+    memset(sbuf, 0, sizeof(struct stat));
+    if (dialects[i].parse(parser, line, sbuf, file, link)) {
+      DEBUG(1, "listing dialect: %s\n", dialects[i].name);
+      __atomic_store_n(&detected, &dialects[i], __ATOMIC_RELAXED);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Listings bigger than LIST_PARALLEL_THRESHOLD are parsed by the listing
+ * threads, a block of about LIST_PARALLEL_BLOCK at a time, in shares of at
+ * least LIST_PARALLEL_PART. Smaller ones are parsed line by line as they
+ * arrive. */
+#define LIST_PARALLEL_THRESHOLD (1024 * 1024)
+#define LIST_PARALLEL_BLOCK (1024 * 1024)
+#define LIST_PARALLEL_PART (64 * 1024)
+#define LIST_MAX_THREADS 16
+
+struct list_entry {
+  struct stat sbuf;
   char *file;
   char *link;
-  const char *start = list;
-  const char *end = list;
-  char found = 0;
-  struct stat stat_buf;
+  char *converted;
+};
+
+/* A run of whole lines of a block, parsed by one thread */
+struct list_part {
+  char *start;
+  char *end;
+  struct list_parser ctx;   /* copy of the listing's, with its own memo */
+  struct buffer entries;    /* struct list_entry */
+  int done;
+  struct list_part *next;
+};
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct list_part *queue;
+  int threads;
+} list_pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0 };
+
+void list_parser_init(struct list_parser *parser, const char *dir,
+                      const char *name, struct stat *sbuf,
+                      char *linkbuf, int linklen,
+                      fuse_cache_dirh_t h, fuse_cache_dirfil_t filler) {
+  time_t tt;
+
+  memset(parser, 0, sizeof(*parser));
+  parser->dir = dir;
+  parser->name = name;
+  parser->sbuf = sbuf;
+  parser->linkbuf = linkbuf;
+  parser->linklen = linklen;
+  parser->h = h;
+  parser->filler = filler;
+  buf_init(&parser->line);
+  buf_init(&parser->path);
+  buf_init(&parser->block);
+
+  PROBE(parse_dir_start, dir);
+
+  tt = time(NULL);
+  gmtime_r(&tt, &parser->now);
+  parser->now.tm_sec = parser->now.tm_min = parser->now.tm_hour = 0;
 
   if (sbuf) memset(sbuf, 0, sizeof(struct stat));
 
@@ -218,82 +504,285 @@ int parse_dir(const char* list, const char* dir,
     sbuf->st_mode |= 0755;
     sbuf->st_size = 1024;
     sbuf->st_nlink = 1;
-    return 0;
+    parser->found = 1;
+    parser->done = 1;
+    return;
   }
+}
 
-  file = malloc(1024);
-  link = malloc(1024);
+/* dir and file joined in the parser's path buffer */
+static const char *full_path(struct list_parser *parser, const char *file) {
+  parser->path.len = 0;
+  if (buf_add_mem(&parser->path, parser->dir, strlen(parser->dir)) == -1 ||
+      buf_add_mem(&parser->path, file, strlen(file) + 1) == -1)
+    return NULL;
+  return (const char*)parser->path.p;
+}
 
-  while ((end = strchr(start, '\n')) != NULL) {
-    char* line;
-    int res;
+/* Parses one NUL terminated line of len bytes. Returns 0 if it isn't an
+ * entry. Safe to call from the listing threads. */
+static int parse_line(struct list_parser *parser, char *line, size_t len,
+                      struct list_entry *entry) {
+  memset(entry, 0, sizeof(*entry));
 
-    memset(&stat_buf, 0, sizeof(stat_buf));
+  if (len > 0 && line[len - 1] == '\r') line[len - 1] = '\0';
 
-    if (end > start && *(end-1) == '\r') end--;
+  if (ftpfs.codepage &&
+      !charset_passthrough(ftpfs.codepage, ftpfs.iocharset, line)) {
+    entry->converted = strdup(line);
+    convert_charsets(ftpfs.codepage, ftpfs.iocharset, &entry->converted);
+    line = entry->converted;
+  }
 
-    line = malloc(end - start + 1);
-    strncpy(line, start, end - start);
-    line[end - start] = '\0';
-    start = *end == '\r' ? end + 2 : end + 1;
+  if (!parse_entry(parser, line, &entry->sbuf, &entry->file, &entry->link)) {
+    free(entry->converted);
+    return 0;
+  }
+  return 1;
+}
 
-    if (ftpfs.codepage) {
-      convert_charsets(ftpfs.codepage, ftpfs.iocharset, &line);
+/* Passes a parsed entry on to the filler or the cache, in listing order */
+static void emit_entry(struct list_parser *parser, struct list_entry *entry) {
+  const char *name = parser->name;
+  char *file = entry->file;
+  char *link = entry->link;
+
+  if (link && link[0]) {
+    char *reallink = link;
+    int linksize;
+    if (link[0] == '/' && ftpfs.symlink_prefix_len) {
+      reallink = g_strdup_printf("%s%s", ftpfs.symlink_prefix, link);
     }
+    linksize = strlen(reallink);
+    if (cache_enabled()) {
+      const char *path = full_path(parser, file);
+      if (path) {
+        cache_add_link(path, reallink, linksize+1);
+        DEBUG(1, "cache_add_link: %s %s\n", path, reallink);
+      }
+    }
+    if (parser->linkbuf && parser->linklen) {
+      if (linksize > parser->linklen) linksize = parser->linklen - 1;
+      strncpy(parser->linkbuf, reallink, linksize);
+      parser->linkbuf[linksize] = '\0';
+    }
+    if (reallink != link) g_free(reallink);
+  }
 
-    file[0] = link[0] = '\0';
-    res = parse_dir_unix(line, &stat_buf, file, link) ||
-          parse_dir_win(line, &stat_buf, file, link) ||
-          parse_dir_netware(line, &stat_buf, file, link);
-
-    if (res) {
-      char *full_path = g_strdup_printf("%s%s", dir, file);
-
-      if (link[0]) {
-        char *reallink;
-        int linksize;
-        if (link[0] == '/' && ftpfs.symlink_prefix_len) {
-          reallink = g_strdup_printf("%s%s", ftpfs.symlink_prefix, link);
-        } else {
-          reallink = g_strdup(link);
-        }
-        linksize = strlen(reallink);
-        if (cache_enabled()) {
-          cache_add_link(full_path, reallink, linksize+1);
-          DEBUG(1, "cache_add_link: %s %s\n", full_path, reallink);
-        }
-        if (linkbuf && linklen) {
-          if (linksize > linklen) linksize = linklen - 1;
-          strncpy(linkbuf, reallink, linksize);
-          linkbuf[linksize] = '\0';
-        }
-        free(reallink);
+  if (parser->h && parser->filler) {
+    DEBUG(1, "filler: %s\n", file);
+    parser->filler(parser->h, file, &entry->sbuf);
+  } else {
+    if (cache_enabled()) {
+      const char *path = full_path(parser, file);
+      if (path) {
+        DEBUG(1, "cache_add_attr: %s\n", path);
+        cache_add_attr(path, &entry->sbuf);
       }
+    }
+  }
+
+  DEBUG(2, "comparing %s %s\n", name, file);
+  if (name && !strcmp(name, file)) {
+    if (parser->sbuf) *parser->sbuf = entry->sbuf;
+    parser->found = 1;
+  }
+
+  free(entry->converted);
+}
+
+static void parse_part(struct list_part *part) {
+  char *line = part->start;
+
+  while (line < part->end) {
+    char *nl = memchr(line, '\n', part->end - line);
+    struct list_entry entry;
+
+    *nl = '\0';
+    if (parse_line(&part->ctx, line, nl - line, &entry) &&
+        buf_add_mem(&part->entries, &entry, sizeof(entry)) == -1)
+      free(entry.converted);
+    line = nl + 1;
+  }
+}
+
+static void *list_thread(void *data) {
+  (void) data;
+
+  pthread_mutex_lock(&list_pool.lock);
+  for (;;) {
+    struct list_part *part;
+    while (list_pool.queue == NULL)
+      pthread_cond_wait(&list_pool.cond, &list_pool.lock);
+    part = list_pool.queue;
+    list_pool.queue = part->next;
+    pthread_mutex_unlock(&list_pool.lock);
+
+    parse_part(part);
+
+    pthread_mutex_lock(&list_pool.lock);
+    part->done = 1;
+    pthread_cond_broadcast(&list_pool.cond);
+  }
+  return NULL;
+}
+
+/* Starts the listing threads the first time they are needed. Returns how
+ * many of them may be used, list_threads can be lowered while mounted. */
+static int list_pool_start(void) {
+  int wanted = ftpfs.list_threads;
+  int threads;
+
+  if (wanted > LIST_MAX_THREADS) wanted = LIST_MAX_THREADS;
+  pthread_mutex_lock(&list_pool.lock);
+  while (list_pool.threads < wanted) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, list_thread, NULL)) break;
+    pthread_detach(thread);
+    list_pool.threads++;
+  }
+  threads = list_pool.threads < wanted ? list_pool.threads : wanted;
+  pthread_mutex_unlock(&list_pool.lock);
+  return threads;
+}
+
+/* Parses the whole lines collected in parser->block, split between the
+ * listing threads and this one, then passes the entries on in order */
+static void parse_block(struct list_parser *parser) {
+  struct list_part parts[LIST_MAX_THREADS + 1];
+  char *start = (char*)parser->block.p;
+  char *end = start + parser->block.len;
+  size_t nparts, threads, i;
+
+  while (end > start && end[-1] != '\n') end--;
+  if (end == start) return;
+
+  threads = list_pool_start();
+  nparts = (end - start) / LIST_PARALLEL_PART;
+  if (nparts > threads + 1) nparts = threads + 1;
+  if (nparts < 1) nparts = 1;
+
+  for (i = 0; i < nparts; i++) {
+    struct list_part *part = &parts[i];
+    part->start = i ? parts[i - 1].end : start;
+    part->end = start + (end - start) * (i + 1) / nparts;
+    while (part->end < end && part->end[-1] != '\n') part->end++;
+    if (part->end < part->start) part->end = part->start;
+    part->ctx = *parser;
+    buf_init(&part->entries);
+    part->done = 0;
+    part->next = NULL;
+  }
+
+  if (nparts > 1) {
+    pthread_mutex_lock(&list_pool.lock);
+    for (i = nparts - 1; i > 0; i--) {
+      parts[i].next = list_pool.queue;
+      list_pool.queue = &parts[i];
+    }
+    pthread_cond_broadcast(&list_pool.cond);
+    pthread_mutex_unlock(&list_pool.lock);
+  }
 
-      if (h && filler) {
-        DEBUG(1, "filler: %s\n", file);
-        filler(h, file, &stat_buf);
-      } else {
-        if (cache_enabled()) {
-          DEBUG(1, "cache_add_attr: %s\n", full_path);
-          cache_add_attr(full_path, &stat_buf);
+  parse_part(&parts[0]);
+
+  if (nparts > 1) {
+    pthread_mutex_lock(&list_pool.lock);
+    for (i = 1; i < nparts; i++) {
+      while (!parts[i].done) {
+        /* Help with what is still queued rather than just waiting */
+        struct list_part *part = list_pool.queue;
+        if (part == NULL) {
+          pthread_cond_wait(&list_pool.cond, &list_pool.lock);
+          continue;
         }
+        list_pool.queue = part->next;
+        pthread_mutex_unlock(&list_pool.lock);
+        parse_part(part);
+        pthread_mutex_lock(&list_pool.lock);
+        part->done = 1;
+        pthread_cond_broadcast(&list_pool.cond);
       }
+    }
+    pthread_mutex_unlock(&list_pool.lock);
+  }
 
-      DEBUG(2, "comparing %s %s\n", name, file);
-      if (name && !strcmp(name, file)) {
-        if (sbuf) *sbuf = stat_buf;
-        found = 1;
-      }
+  for (i = 0; i < nparts; i++) {
+    struct list_entry *entry = (struct list_entry*)parts[i].entries.p;
+    size_t n = parts[i].entries.len / sizeof(*entry);
+    for (; n > 0; n--, entry++) emit_entry(parser, entry);
+    buf_free(&parts[i].entries);
+  }
+  /* Keep the memo warm for the next block */
+  memcpy(parser->dates, parts[nparts - 1].ctx.dates, sizeof(parser->dates));
 
-      free(full_path);
+  parser->block.len = (char*)parser->block.p + parser->block.len - end;
+  memmove(parser->block.p, end, parser->block.len);
+}
+
+void list_parser_feed(struct list_parser *parser,
+                      const char *data, size_t len) {
+  const char *end = data + len;
+
+  if (parser->done) return;
+
+  parser->fed += len;
+  if (ftpfs.list_threads && parser->fed > LIST_PARALLEL_THRESHOLD) {
+    if (parser->line.len) {
+      if (buf_add_mem(&parser->block, parser->line.p, parser->line.len) == -1) {
+        parser->done = 1;
+        return;
+      }
+      parser->line.len = 0;
     }
+    while (data < end) {
+      size_t n = end - data;
+      if (n > LIST_PARALLEL_BLOCK) n = LIST_PARALLEL_BLOCK;
+      if (buf_add_mem(&parser->block, data, n) == -1) {
+        parser->done = 1;
+        return;
+      }
+      data += n;
+      if (parser->block.len >= LIST_PARALLEL_BLOCK) parse_block(parser);
+    }
+    return;
+  }
 
-    free(line);
+  while (data < end) {
+    /* glibc's memchr() already scans a word or vector at a time */
+    const char *nl = memchr(data, '\n', end - data);
+    struct list_entry entry;
+    if (buf_add_mem(&parser->line, data, (nl ? nl : end) - data) == -1 ||
+        buf_add_mem(&parser->line, "", 1) == -1) {
+      parser->done = 1;
+      return;
+    }
+    parser->line.len--;
+    /* Keep the start of the line until the rest arrives */
+    if (nl == NULL) return;
+    if (parse_line(parser, (char*)parser->line.p, parser->line.len, &entry))
+      emit_entry(parser, &entry);
+    parser->line.len = 0;
+    data = nl + 1;
   }
+}
+
+int list_parser_finish(struct list_parser *parser) {
+  if (!parser->done && parser->block.len) parse_block(parser);
+  PROBE(parse_dir_done, parser->dir, parser->fed);
+  buf_free(&parser->line);
+  buf_free(&parser->path);
+  buf_free(&parser->block);
+  return !parser->found;
+}
 
-  free(file);
-  free(link);
+int parse_dir(const char* list, const char* dir,
+              const char* name, struct stat* sbuf,
+              char* linkbuf, int linklen,
+              fuse_cache_dirh_t h, fuse_cache_dirfil_t filler) {
+  struct list_parser parser;
 
-  return !found;
+  list_parser_init(&parser, dir, name, sbuf, linkbuf, linklen, h, filler);
+  list_parser_feed(&parser, list, strlen(list));
+  return list_parser_finish(&parser);
 }
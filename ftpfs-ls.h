@@ -9,7 +9,48 @@
     See the file COPYING.
 */
 
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
 #include "cache.h"
+#include "buffer.h"
+
+#define LIST_DATES 64
+
+/* Parses LIST output incrementally: each complete line is handled as soon
+   as it has been fed, only an unfinished last line is kept. */
+struct list_parser {
+  const char *dir;
+  const char *name;
+  struct stat *sbuf;
+  char *linkbuf;
+  int linklen;
+  fuse_cache_dirh_t h;
+  fuse_cache_dirfil_t filler;
+  struct buffer line;
+  struct buffer path;
+  size_t fed;
+  struct buffer block;    /* lines waiting to be parsed in parallel */
+  int found;
+  int done;
+  /* Dates are read relative to when the listing started, and since a
+     listing has few distinct ones, converted through a small memo */
+  struct tm now;
+  struct {
+    uint64_t key;
+    time_t mtime;
+  } dates[LIST_DATES];
+};
+
+void list_parser_init(struct list_parser *parser, const char *dir,
+                      const char *name, struct stat *sbuf,
+                      char *linkbuf, int linklen,
+                      fuse_cache_dirh_t h, fuse_cache_dirfil_t filler);
+void list_parser_feed(struct list_parser *parser,
+                      const char *data, size_t len);
+/* Returns 0 if name was found, like parse_dir() */
+int list_parser_finish(struct list_parser *parser);
 
 int parse_dir(const char* list, const char* dir,
               const char* name, struct stat* sbuf,
@@ -26,6 +26,7 @@
 #include <glib.h>
 #include <semaphore.h>
 #include <assert.h>
+#include <time.h>
 
 #include "error.h"
 #include "buffer.h"
@@ -33,7 +34,10 @@
 #include "path_utils.h"
 #include "ftpfs-ls.h"
 #include "cache.h"
+#include "control.h"
 #include "passwd.h"
+#include "probes.h"
+#include "stats.h"
 #include "ftpfs.h"
 
 #define MAX_BUFFER_LEN (300*1024)
@@ -41,6 +45,32 @@
 struct ftpfs ftpfs;
 static char error_buf[CURL_ERROR_SIZE];
 
+/* Seconds before logging in a warm connection again after a failure */
+#define KEEPALIVE_LOGIN_RETRY 30
+
+/* Logged-in connections kept for uploads, and the thread keeping them and
+ * the main connection from being dropped by the server while idle */
+struct idle_conn {
+  CURL *easy;
+  time_t last_used;
+};
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t thread;
+  int running;
+  int stop;
+  GQueue idle;            /* of struct idle_conn, least recently used first */
+  unsigned nidle;
+  time_t main_used;       /* when ftpfs.connection last finished a transfer */
+  time_t login_retry;     /* no new connections before this after a failure */
+  struct curl_slist *noop;
+} keepalive = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .cond = PTHREAD_COND_INITIALIZER,
+};
+
 struct ftpfs_file {
   struct buffer buf;
   int dirty;
@@ -62,6 +92,7 @@ struct ftpfs_file {
   int written_flag;
   int write_fail_cause;
   int write_may_start;
+  int synthetic;
   char curl_error_buffer[CURL_ERROR_SIZE];
   off_t pos;
 };
@@ -103,11 +134,55 @@ static int op_return(int err, const char * operation)
     DEBUG(2, "%s successful\n", operation);
     return 0;
   }
-  fprintf(stderr, "ftpfs: operation %s failed because %s\n", operation, strerror(-err));
+  ftpfs_error("ftpfs: operation %s failed because %s\n", operation, strerror(-err));
   return err;
 }
 
 
+/* Records how long the transfer easy just finished took, and what it spent
+ * its time on */
+static void record_transfer(CURL *easy, enum stats_histogram histogram) {
+  double namelookup = 0, connect = 0, appconnect = 0, pretransfer = 0;
+  double starttransfer = 0, total = 0, done;
+
+  if (easy == ftpfs.connection && keepalive.running)
+    __atomic_store_n(&keepalive.main_used, time(NULL), __ATOMIC_RELAXED);
+
+  if (curl_easy_getinfo(easy, CURLINFO_TOTAL_TIME, &total) != CURLE_OK)
+    return;
+  curl_easy_getinfo(easy, CURLINFO_NAMELOOKUP_TIME, &namelookup);
+  curl_easy_getinfo(easy, CURLINFO_CONNECT_TIME, &connect);
+#if LIBCURL_VERSION_NUM >= 0x071300
+  curl_easy_getinfo(easy, CURLINFO_APPCONNECT_TIME, &appconnect);
+#endif
+  curl_easy_getinfo(easy, CURLINFO_PRETRANSFER_TIME, &pretransfer);
+  curl_easy_getinfo(easy, CURLINFO_STARTTRANSFER_TIME, &starttransfer);
+
+  stats_record(histogram, total * 1e6);
+
+  /* curl's times all run from the start of the transfer; record each phase
+     on its own. A reused connection has no lookup or connect phase. */
+  if (namelookup > 0)
+    stats_record(STATS_PHASE_NAMELOOKUP, namelookup * 1e6);
+  if (connect > namelookup)
+    stats_record(STATS_PHASE_CONNECT, (connect - namelookup) * 1e6);
+  done = connect;
+  if (appconnect > done) {
+    stats_record(STATS_PHASE_APPCONNECT, (appconnect - done) * 1e6);
+    done = appconnect;
+  }
+  if (pretransfer >= done) {
+    stats_record(STATS_PHASE_PRETRANSFER, (pretransfer - done) * 1e6);
+    done = pretransfer;
+  }
+  if (starttransfer >= done) {
+    stats_record(STATS_PHASE_STARTTRANSFER, (starttransfer - done) * 1e6);
+    done = starttransfer;
+  }
+  if (total >= done)
+    stats_record(STATS_PHASE_TRANSFER, (total - done) * 1e6);
+}
+
 static size_t write_data(void *ptr, size_t size, size_t nmemb, void *data) {
   struct ftpfs_file* fh = (struct ftpfs_file*)data;
   size_t to_copy;
@@ -120,11 +195,13 @@ static size_t write_data(void *ptr, size_t size, size_t nmemb, void *data) {
   DEBUG(3, "%*s\n", (int)to_copy, (char*)ptr);
   memcpy(ptr, fh->buf.p + fh->copied, to_copy);
   fh->copied += to_copy;
+  stats_add(STATS_BYTES_UP, to_copy);
   return to_copy;
 }
 
 static size_t read_data(void *ptr, size_t size, size_t nmemb, void *data) {
   struct buffer* buf = (struct buffer*)data;
+  stats_add(STATS_BYTES_DOWN, size * nmemb);
   if (buf == NULL) return size * nmemb;
   if (buf_add_mem(buf, ptr, size * nmemb) == -1)
     return 0;
@@ -134,71 +211,149 @@ static size_t read_data(void *ptr, size_t size, size_t nmemb, void *data) {
   return size * nmemb;
 }
 
-static int ftpfs_getdir(const char* path, fuse_cache_dirh_t h,
-                        fuse_cache_dirfil_t filler) {
-  int err = 0;
-  CURLcode curl_res;
-  struct buffer buf;
-  char* dir_path = get_fulldir_path(path);
+static size_t list_data(void *ptr, size_t size, size_t nmemb, void *data) {
+  struct list_parser* parser = (struct list_parser*)data;
+  list_parser_feed(parser, ptr, size * nmemb);
+  stats_add(STATS_BYTES_DOWN, size * nmemb);
 
-  DEBUG(1, "ftpfs_getdir: %s\n", dir_path);
-  buf_init(&buf);
+  DEBUG(2, "list_data: %zu\n", size * nmemb);
+  DEBUG(3, "%*s\n", (int)(size * nmemb), (char*)ptr);
+  return size * nmemb;
+}
+
+/* Lists dir_path, handing each line to the parser as soon as it arrives
+ * instead of collecting the whole listing first */
+static CURLcode ftpfs_list(const char* dir_path, struct list_parser* parser) {
+  CURLcode curl_res;
 
   pthread_mutex_lock(&ftpfs.lock);
   cancel_previous_multi();
   curl_easy_setopt_or_die(ftpfs.connection, CURLOPT_URL, dir_path);
-  curl_easy_setopt_or_die(ftpfs.connection, CURLOPT_WRITEDATA, &buf);
+  curl_easy_setopt_or_die(ftpfs.connection, CURLOPT_WRITEFUNCTION, list_data);
+  curl_easy_setopt_or_die(ftpfs.connection, CURLOPT_WRITEDATA, parser);
+  stats_add(STATS_LIST, 1);
   curl_res = curl_easy_perform(ftpfs.connection);
+  record_transfer(ftpfs.connection, STATS_XFER_LIST);
+  curl_easy_setopt_or_die(ftpfs.connection, CURLOPT_WRITEFUNCTION, read_data);
   pthread_mutex_unlock(&ftpfs.lock);
 
   if (curl_res != 0) {
     DEBUG(1, "%s\n", error_buf);
-    err = -EIO;
+  }
+  return curl_res;
+}
+
+/* Fills sbuf for the files curlftpfs makes up itself, or returns -ENOENT if
+ * path isn't one of them */
+static int synthetic_getattr(const char* path, struct stat* sbuf) {
+  memset(sbuf, 0, sizeof(*sbuf));
+  if (!strcmp(path, STATS_DIR)) {
+    sbuf->st_mode = S_IFDIR | 0555;
+    sbuf->st_nlink = 2;
+  } else if (!strcmp(path, STATS_FILE) || !strcmp(path, STATS_LATENCY_FILE)) {
+    /* The size is unknown until it is read, which direct_io allows */
+    sbuf->st_mode = S_IFREG | 0444;
+    sbuf->st_nlink = 1;
   } else {
-    buf_null_terminate(&buf);
-    parse_dir((char*)buf.p, dir_path + strlen(ftpfs.host) - 1,
-              NULL, NULL, NULL, 0, h, filler);
+    return -ENOENT;
+  }
+  sbuf->st_mtime = sbuf->st_ctime = sbuf->st_atime = time(NULL);
+  return 0;
+}
+
+static int ftpfs_getdir(const char* path, fuse_cache_dirh_t h,
+                        fuse_cache_dirfil_t filler) {
+  int err = 0;
+  struct list_parser parser;
+  char* dir_path;
+
+  if (!strcmp(path, STATS_DIR)) {
+    struct stat sbuf;
+    synthetic_getattr(STATS_FILE, &sbuf);
+    filler(h, STATS_FILE + strlen(STATS_DIR) + 1, &sbuf);
+    filler(h, STATS_LATENCY_FILE + strlen(STATS_DIR) + 1, &sbuf);
+    return 0;
+  }
+
+  dir_path = get_fulldir_path(path);
+  DEBUG(1, "ftpfs_getdir: %s\n", dir_path);
+  list_parser_init(&parser, dir_path + strlen(ftpfs.host) - 1,
+                   NULL, NULL, NULL, 0, h, filler);
+
+  if (ftpfs_list(dir_path, &parser) != 0) {
+    err = -EIO;
   }
+  list_parser_finish(&parser);
 
   free(dir_path);
-  buf_free(&buf);
   return op_return(err, "ftpfs_getdir");
 }
 
 static int ftpfs_getattr(const char* path, struct stat* sbuf) {
   int err;
-  CURLcode curl_res;
-  struct buffer buf;
+  struct list_parser parser;
   char* name;
-  char* dir_path = get_dir_path(path);
+  char* dir_path;
+
+  if (!strncmp(path, STATS_DIR, strlen(STATS_DIR)) &&
+      (path[strlen(STATS_DIR)] == '\0' || path[strlen(STATS_DIR)] == '/'))
+    return synthetic_getattr(path, sbuf);
 
+  dir_path = get_dir_path(path);
   DEBUG(2, "ftpfs_getattr: %s dir_path=%s\n", path, dir_path);
+
+  name = strrchr(path, '/');
+  ++name;
+  list_parser_init(&parser, dir_path + strlen(ftpfs.host) - 1,
+                   name, sbuf, NULL, 0, NULL, NULL);
+  ftpfs_list(dir_path, &parser);
+  err = list_parser_finish(&parser);
+
+  free(dir_path);
+  if (err) return op_return(-ENOENT, "ftpfs_getattr");
+  return 0;
+}
+
+
+/* Returns the size of the file at path as reported by the server's SIZE
+ * command, or -1 if the server couldn't tell */
+static off_t ftpfs_remote_size(const char* path) {
+  CURLcode curl_res;
+  struct buffer buf;
+  double size = -1;
+  char* full_path;
+
+  if (!ftpfs.safe_nobody) return -1;
+
+  full_path = get_full_path(path);
+  DEBUG(2, "ftpfs_remote_size: %s\n", full_path);
   buf_init(&buf);
 
   pthread_mutex_lock(&ftpfs.lock);
   cancel_previous_multi();
-  curl_easy_setopt_or_die(ftpfs.connection, CURLOPT_URL, dir_path);
+  curl_easy_setopt_or_die(ftpfs.connection, CURLOPT_URL, full_path);
   curl_easy_setopt_or_die(ftpfs.connection, CURLOPT_WRITEDATA, &buf);
+  curl_easy_setopt_or_die(ftpfs.connection, CURLOPT_NOBODY, 1);
+  stats_add(STATS_COMMANDS, 1);
   curl_res = curl_easy_perform(ftpfs.connection);
+  record_transfer(ftpfs.connection, STATS_XFER_COMMAND);
+  if (curl_res == CURLE_OK &&
+      curl_easy_getinfo(ftpfs.connection, CURLINFO_CONTENT_LENGTH_DOWNLOAD,
+                        &size) != CURLE_OK)
+    size = -1;
+  curl_easy_setopt_or_die(ftpfs.connection, CURLOPT_NOBODY, 0);
   pthread_mutex_unlock(&ftpfs.lock);
 
   if (curl_res != 0) {
     DEBUG(1, "%s\n", error_buf);
+    size = -1;
   }
-  buf_null_terminate(&buf);
-
-  name = strrchr(path, '/');
-  ++name;
-  err = parse_dir((char*)buf.p, dir_path + strlen(ftpfs.host) - 1,
-                  name, sbuf, NULL, 0, NULL, NULL);
 
-  free(dir_path);
+  free(full_path);
   buf_free(&buf);
-  if (err) return op_return(-ENOENT, "ftpfs_getattr");
-  return 0;
+  return size < 0 ? -1 : (off_t) size;
 }
 
-
 static int check_running(void) {
   int running_handles = 0;
   curl_multi_perform(ftpfs.multi, &running_handles);
@@ -239,6 +394,14 @@ static size_t ftpfs_read_chunk(const char* full_path, char* rbuf,
       DEBUG(2, "current_fh=%p fh=%p\n", (void *) ftpfs.current_fh, (void *) fh);
       DEBUG(2, "buf.begin_offset=%lld offset=%lld\n", (long long) fh->buf.begin_offset, (long long) offset);
 
+      stats_add(STATS_RETR, 1);
+      if (offset) {
+        stats_add(STATS_READ_RESTARTS, 1);
+        PROBE(read_restart, full_path, (long long) offset);
+      } else {
+        PROBE(read_start, full_path, (long long) offset);
+      }
+
       buf_clear(&fh->buf);
       fh->buf.begin_offset = offset;
       ftpfs.current_fh = fh;
@@ -307,6 +470,8 @@ static size_t ftpfs_read_chunk(const char* full_path, char* rbuf,
           DEBUG(1, "error: curl_multi_info %d\n", msg->msg);
           err = 1;
         }
+        if (msg != NULL && msg->msg == CURLMSG_DONE)
+          record_transfer(msg->easy_handle, STATS_XFER_RETR);
       }
     }
   }
@@ -363,6 +528,8 @@ static size_t write_data_bg(void *ptr, size_t size, size_t nmemb, void *data) {
     to_copy = fh->stream_buf.len;
 
   memcpy(ptr, fh->stream_buf.p, to_copy);
+  stats_add(STATS_BYTES_UP, to_copy);
+  PROBE(upload_chunk, fh->full_path, to_copy, fh->stream_buf.len - to_copy);
   if (fh->stream_buf.len > to_copy) {
     size_t newlen = fh->stream_buf.len - to_copy;
     memmove(fh->stream_buf.p, fh->stream_buf.p + to_copy, newlen);
@@ -412,7 +579,9 @@ static void *ftpfs_write_thread(void *data) {
     /*curl_easy_setopt_or_die(fh->write_conn, CURLOPT_RESUME_FROM_LARGE, (curl_off_t)fh->pos); */
   }
 
+  stats_add(STATS_STOR, 1);
   curl_res = curl_easy_perform(fh->write_conn);
+  record_transfer(fh->write_conn, STATS_XFER_STOR);
 
   curl_easy_setopt_or_die(fh->write_conn, CURLOPT_UPLOAD, 0);
 
@@ -434,6 +603,226 @@ static void *ftpfs_write_thread(void *data) {
   return NULL;
 }
 
+/* Sends a NOOP on the connection of easy, which logs in first if it has
+ * been dropped. Returns 0 or -EIO. */
+static int send_noop(CURL *easy)
+{
+  struct buffer buf;
+  CURLcode curl_res;
+
+  buf_init(&buf);
+  curl_easy_setopt_or_die(easy, CURLOPT_POSTQUOTE, keepalive.noop);
+  curl_easy_setopt_or_die(easy, CURLOPT_URL, ftpfs.host);
+  curl_easy_setopt_or_die(easy, CURLOPT_WRITEDATA, &buf);
+  curl_easy_setopt_or_die(easy, CURLOPT_NOBODY, ftpfs.safe_nobody);
+
+  stats_add(STATS_COMMANDS, 1);
+  curl_res = curl_easy_perform(easy);
+  record_transfer(easy, STATS_XFER_COMMAND);
+
+  curl_easy_setopt_or_die(easy, CURLOPT_POSTQUOTE, NULL);
+  curl_easy_setopt_or_die(easy, CURLOPT_NOBODY, 0);
+  curl_easy_setopt_or_die(easy, CURLOPT_WRITEDATA, NULL);
+  buf_free(&buf);
+
+  DEBUG(2, "keepalive: NOOP on %p: %d\n", easy, curl_res);
+  return curl_res == CURLE_OK ? 0 : -EIO;
+}
+
+static void close_connection(CURL *easy)
+{
+  curl_easy_cleanup(easy);
+  stats_add(STATS_CONNECTIONS, -1);
+}
+
+/* Returns a logged-in connection for an upload, or NULL if none is ready */
+static CURL *take_idle_connection(void)
+{
+  CURL *easy = NULL;
+
+  pthread_mutex_lock(&keepalive.lock);
+  if (keepalive.nidle) {
+    struct idle_conn *conn = g_queue_pop_head(&keepalive.idle);
+    keepalive.nidle--;
+    easy = conn->easy;
+    g_free(conn);
+    /* Have it replaced */
+    pthread_cond_signal(&keepalive.cond);
+  }
+  pthread_mutex_unlock(&keepalive.lock);
+  return easy;
+}
+
+/* Keeps the connection of a finished upload for the next one if fewer than
+ * warm_connections are, closes it otherwise */
+static void release_write_conn(CURL *easy, int ok)
+{
+  struct idle_conn *conn;
+
+  pthread_mutex_lock(&keepalive.lock);
+  if (!ok || !keepalive.running || keepalive.nidle >= ftpfs.warm_connections) {
+    pthread_mutex_unlock(&keepalive.lock);
+    close_connection(easy);
+    return;
+  }
+  pthread_mutex_unlock(&keepalive.lock);
+
+  /* Undo what ftpfs_write_thread set up for this upload */
+  curl_easy_setopt_or_die(easy, CURLOPT_URL, ftpfs.host);
+  curl_easy_setopt_or_die(easy, CURLOPT_READFUNCTION, write_data);
+  curl_easy_setopt_or_die(easy, CURLOPT_READDATA, NULL);
+  curl_easy_setopt_or_die(easy, CURLOPT_LOW_SPEED_LIMIT, 0);
+  curl_easy_setopt_or_die(easy, CURLOPT_LOW_SPEED_TIME, 0);
+  curl_easy_setopt_or_die(easy, CURLOPT_ERRORBUFFER, error_buf);
+  curl_easy_setopt_or_die(easy, CURLOPT_APPEND, 0);
+
+  conn = g_new(struct idle_conn, 1);
+  conn->easy = easy;
+  conn->last_used = time(NULL);
+  pthread_mutex_lock(&keepalive.lock);
+  g_queue_push_tail(&keepalive.idle, conn);
+  keepalive.nidle++;
+  pthread_mutex_unlock(&keepalive.lock);
+}
+
+/* Logs in connections until warm_connections are ready, sends a NOOP on
+ * those idle for keepalive seconds and on the main connection if it is.
+ * Called and returns with keepalive.lock held. */
+static void keepalive_round(void)
+{
+  time_t now = time(NULL);
+  unsigned tries;
+
+  for (tries = 0; keepalive.nidle < ftpfs.warm_connections && tries < 2 &&
+       now >= keepalive.login_retry; tries++) {
+    struct idle_conn *conn;
+    CURL *easy;
+
+    pthread_mutex_unlock(&keepalive.lock);
+    easy = curl_easy_init();
+    if (easy != NULL) {
+      stats_add(STATS_CONNECTIONS, 1);
+      set_common_curl_stuff(easy);
+      if (send_noop(easy)) {
+        close_connection(easy);
+        easy = NULL;
+      }
+    }
+    pthread_mutex_lock(&keepalive.lock);
+    if (easy == NULL) {
+      keepalive.login_retry = now + KEEPALIVE_LOGIN_RETRY;
+      continue;
+    }
+    conn = g_new(struct idle_conn, 1);
+    conn->easy = easy;
+    conn->last_used = now;
+    g_queue_push_tail(&keepalive.idle, conn);
+    keepalive.nidle++;
+  }
+
+  if (!ftpfs.keepalive)
+    return;
+
+  /* The least recently used come first, stop at the first one still busy
+   * enough */
+  while (keepalive.nidle && !keepalive.stop) {
+    struct idle_conn *conn = g_queue_peek_head_link(&keepalive.idle)->data;
+    int err;
+
+    if (now - conn->last_used < ftpfs.keepalive)
+      break;
+    g_queue_pop_head(&keepalive.idle);
+    keepalive.nidle--;
+    pthread_mutex_unlock(&keepalive.lock);
+    err = send_noop(conn->easy);
+    if (err) {
+      close_connection(conn->easy);
+      g_free(conn);
+    }
+    pthread_mutex_lock(&keepalive.lock);
+    if (!err) {
+      conn->last_used = now;
+      g_queue_push_tail(&keepalive.idle, conn);
+      keepalive.nidle++;
+    }
+  }
+
+  /* Leave the main connection alone while it is busy or streaming a file */
+  if (now - __atomic_load_n(&keepalive.main_used, __ATOMIC_RELAXED) >=
+      ftpfs.keepalive) {
+    pthread_mutex_unlock(&keepalive.lock);
+    if (pthread_mutex_trylock(&ftpfs.lock) == 0) {
+      if (!ftpfs.attached_to_multi)
+        send_noop(ftpfs.connection);
+      else
+        __atomic_store_n(&keepalive.main_used, now, __ATOMIC_RELAXED);
+      pthread_mutex_unlock(&ftpfs.lock);
+    }
+    pthread_mutex_lock(&keepalive.lock);
+  }
+}
+
+static void *keepalive_thread(void *data)
+{
+  (void) data;
+
+  pthread_mutex_lock(&keepalive.lock);
+  while (!keepalive.stop) {
+    struct timespec ts;
+
+    keepalive_round();
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec++;
+    pthread_cond_timedwait(&keepalive.cond, &keepalive.lock, &ts);
+  }
+  pthread_mutex_unlock(&keepalive.lock);
+  return NULL;
+}
+
+static void start_keepalive(void)
+{
+  int err;
+
+  if (!ftpfs.keepalive && !ftpfs.warm_connections)
+    return;
+
+  keepalive.noop = curl_slist_append(NULL, "NOOP");
+  keepalive.main_used = time(NULL);
+  g_queue_init(&keepalive.idle);
+  keepalive.running = 1;
+  err = pthread_create(&keepalive.thread, NULL, keepalive_thread, NULL);
+  if (err) {
+    ftpfs_error("failed to create keepalive thread: %s\n", strerror(err));
+    keepalive.running = 0;
+  }
+}
+
+void stop_keepalive(void)
+{
+  struct idle_conn *conn;
+
+  if (!keepalive.running)
+    return;
+
+  pthread_mutex_lock(&keepalive.lock);
+  keepalive.stop = 1;
+  pthread_cond_signal(&keepalive.cond);
+  pthread_mutex_unlock(&keepalive.lock);
+  pthread_join(keepalive.thread, NULL);
+
+  pthread_mutex_lock(&keepalive.lock);
+  keepalive.running = 0;
+  while ((conn = g_queue_pop_head(&keepalive.idle)) != NULL) {
+    close_connection(conn->easy);
+    g_free(conn);
+  }
+  keepalive.nidle = 0;
+  pthread_mutex_unlock(&keepalive.lock);
+  curl_slist_free_all(keepalive.noop);
+  keepalive.noop = NULL;
+}
+
 /* returns 1 on success, 0 on failure */
 static int start_write_thread(struct ftpfs_file *fh)
 {
@@ -451,20 +840,27 @@ static int start_write_thread(struct ftpfs_file *fh)
   sem_init(&fh->data_written, 0, 0);
   sem_init(&fh->ready, 0, 0);
 
-    fh->write_conn = curl_easy_init();
+    fh->write_conn = take_idle_connection();
+    if (fh->write_conn == NULL) {
+      fh->write_conn = curl_easy_init();
+      if (fh->write_conn != NULL) {
+        stats_add(STATS_CONNECTIONS, 1);
+        set_common_curl_stuff(fh->write_conn);
+      }
+    }
     if (fh->write_conn == NULL) {
-      fprintf(stderr, "Error initializing libcurl\n");
+      ftpfs_error("Error initializing libcurl\n");
       return 0;
     } else {
       int err;
-      set_common_curl_stuff(fh->write_conn);
       err = pthread_create(&fh->thread_id, NULL, ftpfs_write_thread, fh);
       if (err) {
-        fprintf(stderr, "failed to create thread: %s\n", strerror(err));
+        ftpfs_error("failed to create thread: %s\n", strerror(err));
         /* FIXME: destroy curl_easy */
         return 0;
       }
     }
+  stats_add(STATS_UPLOADS, 1);
   return 1;
 }
 
@@ -480,8 +876,9 @@ static int finish_write_thread(struct ftpfs_file *fh)
     pthread_join(fh->thread_id, NULL);
     DEBUG(2, "finish_write_thread after pthread_join. write_fail_cause=%d\n", fh->write_fail_cause);
 
-    curl_easy_cleanup(fh->write_conn);
+    release_write_conn(fh->write_conn, fh->write_fail_cause == CURLE_OK);
     fh->write_conn = NULL;
+    stats_add(STATS_UPLOADS, -1);
 
     sem_destroy(&fh->data_avail);
     sem_destroy(&fh->data_need);
@@ -497,8 +894,10 @@ static int finish_write_thread(struct ftpfs_file *fh)
 
 
 static void free_ftpfs_file(struct ftpfs_file *fh) {
-  if (fh->write_conn)
+  if (fh->write_conn) {
     curl_easy_cleanup(fh->write_conn);
+    stats_add(STATS_CONNECTIONS, -1);
+  }
   g_free(fh->full_path);
   g_free(fh->open_path);
   sem_destroy(&fh->data_avail);
@@ -545,7 +944,9 @@ static int create_empty_file(const char * path)
   curl_easy_setopt_or_die(ftpfs.connection, CURLOPT_INFILESIZE, 0);
   curl_easy_setopt_or_die(ftpfs.connection, CURLOPT_UPLOAD, 1);
   curl_easy_setopt_or_die(ftpfs.connection, CURLOPT_READDATA, NULL);
+  stats_add(STATS_STOR, 1);
   curl_res = curl_easy_perform(ftpfs.connection);
+  record_transfer(ftpfs.connection, STATS_XFER_STOR);
   curl_easy_setopt_or_die(ftpfs.connection, CURLOPT_UPLOAD, 0);
   pthread_mutex_unlock(&ftpfs.lock);
 
@@ -623,7 +1024,20 @@ static int ftpfs_open_common(const char* path, mode_t mode,
   fh->write_may_start = 0;
   fi->fh = (unsigned long) fh;
 
-  if ((fi->flags & O_ACCMODE) == O_RDONLY) {
+  if (!strcmp(path, STATS_FILE) || !strcmp(path, STATS_LATENCY_FILE)) {
+    /* Snapshot the statistics, read past any size the kernel has seen */
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+      err = -EACCES;
+    } else {
+      char *text = strcmp(path, STATS_FILE) ? stats_format_latency()
+                                            : stats_format();
+      if (buf_add_mem(&fh->buf, text, strlen(text)) == -1)
+        err = -ENOMEM;
+      g_free(text);
+      fh->synthetic = 1;
+      fi->direct_io = 1;
+    }
+  } else if ((fi->flags & O_ACCMODE) == O_RDONLY) {
     if (fi->flags & O_CREAT) {
       err = ftpfs_mknod(path, (mode & 07777) | S_IFREG, 0);
     } else {
@@ -728,9 +1142,16 @@ static int ftpfs_read(const char* path, char* rbuf, size_t size, off_t offset,
 
   DEBUG(1, "ftpfs_read: %s size=%zu offset=%lld has_write_conn=%d pos=%lld\n", path, size, (long long) offset, fh->write_conn!=0, (long long) fh->pos);
 
+  if (fh->synthetic) {
+    if (offset >= (off_t) fh->buf.len) return 0;
+    if (size > fh->buf.len - offset) size = fh->buf.len - offset;
+    memcpy(rbuf, fh->buf.p + offset, size);
+    return size;
+  }
+
   if (fh->pos>0 || fh->write_conn!=NULL)
   {
-    fprintf(stderr, "in read/write mode we cannot read from a file that has already been written to\n");
+    ftpfs_error("in read/write mode we cannot read from a file that has already been written to\n");
     return op_return(-EIO, "ftpfs_read");
   }
 
@@ -787,7 +1208,9 @@ static int ftpfs_do_cmd(struct curl_slist *header, const char *path) {
   curl_easy_setopt_or_die(ftpfs.connection, CURLOPT_WRITEDATA, &buf);
   curl_easy_setopt_or_die(ftpfs.connection, CURLOPT_NOBODY,  ftpfs.safe_nobody);
 
+  stats_add(STATS_COMMANDS, 1);
   curl_res = curl_easy_perform(ftpfs.connection);
+  record_transfer(ftpfs.connection, STATS_XFER_COMMAND);
 
   curl_easy_setopt_or_die(ftpfs.connection, CURLOPT_POSTQUOTE, NULL);
   curl_easy_setopt_or_die(ftpfs.connection, CURLOPT_NOBODY,    0);
@@ -996,7 +1419,7 @@ static int ftpfs_write(const char *path, const char *wbuf, size_t size,
       long long path_size = (long long int)test_size(path);
       if (path_size != 0)
       {
-        fprintf(stderr, "ftpfs_write: start writing with no previous truncate not allowed! size check rval=%lld\n", path_size);
+        ftpfs_error("ftpfs_write: start writing with no previous truncate not allowed! size check rval=%lld\n", path_size);
         return op_return(-EIO, "ftpfs_write");
       }
     }
@@ -1074,16 +1497,24 @@ static int ftpfs_flush(const char *path, struct fuse_file_info *fi) {
     err = finish_write_thread(fh);
     if (err) return op_return(err, "ftpfs_flush");
 
+    if (ftpfs.upload_verify == UPLOAD_VERIFY_NONE)
+      return 0;
+
     /* check if the resulting file has the correct size
      this is important, because we use APPE for continuing
      writing after a premature flush */
-    err = ftpfs_getattr(path, &sbuf);
-    if (err) return op_return(err, "ftpfs_flush");
+    sbuf.st_size = -1;
+    if (ftpfs.upload_verify == UPLOAD_VERIFY_SIZE)
+      sbuf.st_size = ftpfs_remote_size(path);
+    if (sbuf.st_size < 0) {
+      err = ftpfs_getattr(path, &sbuf);
+      if (err) return op_return(err, "ftpfs_flush");
+    }
 
     if (sbuf.st_size != fh->pos)
     {
       fh->write_fail_cause = -999;
-      fprintf(stderr, "ftpfs_flush: check filesize problem: size=%lld expected=%lld\n", (long long) sbuf.st_size, (long long) fh->pos);
+      ftpfs_error("ftpfs_flush: check filesize problem: size=%lld expected=%lld\n", (long long) sbuf.st_size, (long long) fh->pos);
       return op_return(-EIO, "ftpfs_flush");
     }
 
@@ -1151,33 +1582,20 @@ static int ftpfs_rename(const char *from, const char *to) {
 
 static int ftpfs_readlink(const char *path, char *linkbuf, size_t size) {
   int err;
-  CURLcode curl_res;
+  struct list_parser parser;
   char *name;
   char* dir_path = get_dir_path(path);
-  struct buffer buf;
 
   DEBUG(2, "dir_path: %s %s\n", path, dir_path);
-  buf_init(&buf);
-
-  pthread_mutex_lock(&ftpfs.lock);
-  cancel_previous_multi();
-  curl_easy_setopt_or_die(ftpfs.connection, CURLOPT_URL, dir_path);
-  curl_easy_setopt_or_die(ftpfs.connection, CURLOPT_WRITEDATA, &buf);
-  curl_res = curl_easy_perform(ftpfs.connection);
-  pthread_mutex_unlock(&ftpfs.lock);
-
-  if (curl_res != 0) {
-    DEBUG(1, "%s\n", error_buf);
-  }
-  buf_null_terminate(&buf);
 
   name = strrchr(path, '/');
   ++name;
-  err = parse_dir((char*)buf.p, dir_path + strlen(ftpfs.host) - 1,
-                  name, NULL, linkbuf, size, NULL, NULL);
+  list_parser_init(&parser, dir_path + strlen(ftpfs.host) - 1,
+                   name, NULL, linkbuf, size, NULL, NULL);
+  ftpfs_list(dir_path, &parser);
+  err = list_parser_finish(&parser);
 
   free(dir_path);
-  buf_free(&buf);
   if (err) return op_return(-ENOENT, "ftpfs_readlink");
   return op_return(0, "ftpfs_readlink");
 }
@@ -1213,35 +1631,128 @@ static int ftpfs_statfs(const char *path, struct statfs *buf)
 }
 #endif
 
+/* Every operation FUSE hands over records how long it took, and can be
+ * traced. The first argument of each is the path it acts on. */
+#define FIRST_ARG(...) FIRST_ARG_(__VA_ARGS__, 0)
+#define FIRST_ARG_(arg, ...) arg
+
+#define TIMED_OP(name, histogram, params, args) \
+  static int timed_##name params { \
+    uint64_t start = stats_clock(); \
+    int ret; \
+    PROBE(op_entry, #name, FIRST_ARG args); \
+    ret = ftpfs_##name args; \
+    stats_time(histogram, start); \
+    PROBE(op_return, #name, FIRST_ARG args, ret); \
+    return ret; \
+  }
+
+TIMED_OP(getattr, STATS_OP_GETATTR,
+         (const char *path, struct stat *sbuf), (path, sbuf))
+TIMED_OP(readlink, STATS_OP_READLINK,
+         (const char *path, char *linkbuf, size_t size),
+         (path, linkbuf, size))
+TIMED_OP(getdir, STATS_OP_GETDIR,
+         (const char *path, fuse_cache_dirh_t h, fuse_cache_dirfil_t filler),
+         (path, h, filler))
+TIMED_OP(mknod, STATS_OP_MKNOD,
+         (const char *path, mode_t mode, dev_t rdev), (path, mode, rdev))
+TIMED_OP(mkdir, STATS_OP_MKDIR, (const char *path, mode_t mode), (path, mode))
+TIMED_OP(unlink, STATS_OP_UNLINK, (const char *path), (path))
+TIMED_OP(rmdir, STATS_OP_RMDIR, (const char *path), (path))
+TIMED_OP(rename, STATS_OP_RENAME, (const char *from, const char *to),
+         (from, to))
+TIMED_OP(chmod, STATS_OP_CHMOD, (const char *path, mode_t mode), (path, mode))
+TIMED_OP(chown, STATS_OP_CHOWN, (const char *path, uid_t uid, gid_t gid),
+         (path, uid, gid))
+TIMED_OP(truncate, STATS_OP_TRUNCATE, (const char *path, off_t offset),
+         (path, offset))
+TIMED_OP(utime, STATS_OP_UTIME, (const char *path, struct utimbuf *time),
+         (path, time))
+TIMED_OP(open, STATS_OP_OPEN, (const char *path, struct fuse_file_info *fi),
+         (path, fi))
+TIMED_OP(flush, STATS_OP_FLUSH, (const char *path, struct fuse_file_info *fi),
+         (path, fi))
+TIMED_OP(fsync, STATS_OP_FSYNC,
+         (const char *path, int isdatasync, struct fuse_file_info *fi),
+         (path, isdatasync, fi))
+TIMED_OP(release, STATS_OP_RELEASE,
+         (const char *path, struct fuse_file_info *fi), (path, fi))
+TIMED_OP(read, STATS_OP_READ,
+         (const char *path, char *rbuf, size_t size, off_t offset,
+          struct fuse_file_info *fi), (path, rbuf, size, offset, fi))
+TIMED_OP(write, STATS_OP_WRITE,
+         (const char *path, const char *wbuf, size_t size, off_t offset,
+          struct fuse_file_info *fi), (path, wbuf, size, offset, fi))
+#if FUSE_VERSION >= 25
+TIMED_OP(statfs, STATS_OP_STATFS, (const char *path, struct statvfs *buf),
+         (path, buf))
+TIMED_OP(create, STATS_OP_CREATE,
+         (const char *path, mode_t mode, struct fuse_file_info *fi),
+         (path, mode, fi))
+TIMED_OP(ftruncate, STATS_OP_FTRUNCATE,
+         (const char *path, off_t offset, struct fuse_file_info *fi),
+         (path, offset, fi))
+#else
+TIMED_OP(statfs, STATS_OP_STATFS, (const char *path, struct statfs *buf),
+         (path, buf))
+#endif
+
+#if FUSE_VERSION >= 23
+/* Runs once fuse_main() has daemonized, threads started earlier would not
+ * have survived the fork */
+#if FUSE_VERSION >= 26
+static void *ftpfs_init(struct fuse_conn_info *conn)
+#else
+static void *ftpfs_init(void)
+#endif
+{
+#if FUSE_VERSION >= 26
+  (void) conn;
+#endif
+  ftpfs_log_start(&ftpfs.debug);
+  start_keepalive();
+  if (ftpfs.control) {
+    int err = control_start(ftpfs.control);
+    if (err)
+      ftpfs_error("ftpfs: cannot serve %s: %s\n", ftpfs.control,
+                  strerror(-err));
+  }
+  return NULL;
+}
+#endif
+
 struct fuse_cache_operations ftpfs_oper = {
   .oper = {
-/*    .init       = ftpfs_init, */
-    .getattr    = ftpfs_getattr,
-    .readlink   = ftpfs_readlink,
-    .mknod      = ftpfs_mknod,
-    .mkdir      = ftpfs_mkdir,
+#if FUSE_VERSION >= 23
+    .init       = ftpfs_init,
+#endif
+    .getattr    = timed_getattr,
+    .readlink   = timed_readlink,
+    .mknod      = timed_mknod,
+    .mkdir      = timed_mkdir,
 /*    .symlink    = ftpfs_symlink, */
-    .unlink     = ftpfs_unlink,
-    .rmdir      = ftpfs_rmdir,
-    .rename     = ftpfs_rename,
-    .chmod      = ftpfs_chmod,
-    .chown      = ftpfs_chown,
-    .truncate   = ftpfs_truncate,
-    .utime      = ftpfs_utime,
-    .open       = ftpfs_open,
-    .flush      = ftpfs_flush,
-    .fsync      = ftpfs_fsync,
-    .release    = ftpfs_release,
-    .read       = ftpfs_read,
-    .write      = ftpfs_write,
-    .statfs     = ftpfs_statfs,
+    .unlink     = timed_unlink,
+    .rmdir      = timed_rmdir,
+    .rename     = timed_rename,
+    .chmod      = timed_chmod,
+    .chown      = timed_chown,
+    .truncate   = timed_truncate,
+    .utime      = timed_utime,
+    .open       = timed_open,
+    .flush      = timed_flush,
+    .fsync      = timed_fsync,
+    .release    = timed_release,
+    .read       = timed_read,
+    .write      = timed_write,
+    .statfs     = timed_statfs,
 #if FUSE_VERSION >= 25
-    .create     = ftpfs_create,
-    .ftruncate  = ftpfs_ftruncate,
+    .create     = timed_create,
+    .ftruncate  = timed_ftruncate,
 /*    .fgetattr   = ftpfs_fgetattr, */
 #endif
   },
-  .cache_getdir = ftpfs_getdir,
+  .cache_getdir = timed_getdir,
 };
 
 static int ftpfilemethod(const char *str)
@@ -78,6 +78,27 @@ struct ftpfs {
   const char *codepage;
   const char *iocharset;
   int multiconn;
+  int upload_verify;
+  int list_dialect;
+  int list_threads;
+  char* control;
+  unsigned keepalive;
+  unsigned warm_connections;
+};
+
+/* How ftpfs_flush checks that a streamed upload arrived in full */
+enum {
+  UPLOAD_VERIFY_SIZE,   /* SIZE command, falling back to LIST */
+  UPLOAD_VERIFY_NONE,   /* trust the transfer's own completion reply */
+  UPLOAD_VERIFY_LIST    /* LIST the parent directory */
+};
+
+/* Format of the server's LIST output */
+enum {
+  LIST_DIALECT_AUTO,    /* detect it from the first entries */
+  LIST_DIALECT_UNIX,
+  LIST_DIALECT_DOS,
+  LIST_DIALECT_NETWARE
 };
 
 extern struct ftpfs ftpfs;
@@ -91,6 +112,7 @@ extern struct fuse_cache_operations ftpfs_oper;
 
 void cancel_previous_multi(void);
 void set_common_curl_stuff(CURL* easy);
+void stop_keepalive(void);
 
 void ftpfs_curl_easy_setopt_abort(void);
 
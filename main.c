@@ -12,6 +12,7 @@
 #include <stdio.h>  /* fprintf(), stderr */
 
 #include <pthread.h> /* pthread_*() */
+#include <unistd.h>  /* getcwd(), sysconf() */
 
 #include <curl/curl.h>
 #include <curl/easy.h>
@@ -21,7 +22,10 @@
 #include "ftpfs.h"         /* ftpfs */
 #include "cache.h"         /* cache_init(), CACHE_* */
 #include "charset_utils.h" /* convert_charsets() */
+#include "control.h"       /* control_stop() */
+#include "error.h"         /* ftpfs_log_stop() */
 #include "passwd.h"        /* prompt_passwd() */
+#include "stats.h"         /* stats_add() */
 
 #include "config.h" /* VERSION */
 
@@ -33,6 +37,13 @@ enum {
 
 #define FTPFS_OPT(t, p, v) { t, offsetof(struct ftpfs, p), v }
 
+/* The kernel keeps lookups and attributes for this fraction of
+   cache_stat_timeout */
+#define KERNEL_TIMEOUT_DIVISOR 4
+
+/* and for at most this many seconds when a control socket is served */
+#define CONTROL_KERNEL_TIMEOUT 1
+
 static struct fuse_opt ftpfs_opts[] = {
   FTPFS_OPT("ftpfs_debug=%u",     debug, 0),
   FTPFS_OPT("transform_symlinks", transform_symlinks, 1),
@@ -42,6 +53,17 @@ static struct fuse_opt ftpfs_opts[] = {
   FTPFS_OPT("ftp_port=%s",        ftp_port, 0),
   FTPFS_OPT("disable_eprt",       disable_eprt, 1),
   FTPFS_OPT("ftp_method=%s",      ftp_method, 0),
+  FTPFS_OPT("upload_verify=size", upload_verify, UPLOAD_VERIFY_SIZE),
+  FTPFS_OPT("upload_verify=none", upload_verify, UPLOAD_VERIFY_NONE),
+  FTPFS_OPT("upload_verify=list", upload_verify, UPLOAD_VERIFY_LIST),
+  FTPFS_OPT("list_dialect=auto",  list_dialect, LIST_DIALECT_AUTO),
+  FTPFS_OPT("list_dialect=unix",  list_dialect, LIST_DIALECT_UNIX),
+  FTPFS_OPT("list_dialect=dos",   list_dialect, LIST_DIALECT_DOS),
+  FTPFS_OPT("list_dialect=netware", list_dialect, LIST_DIALECT_NETWARE),
+  FTPFS_OPT("list_threads=%u",    list_threads, 0),
+  FTPFS_OPT("control=%s",         control, 0),
+  FTPFS_OPT("keepalive=%u",       keepalive, 0),
+  FTPFS_OPT("warm_connections=%u", warm_connections, 0),
   FTPFS_OPT("custom_list=%s",     custom_list, 0),
   FTPFS_OPT("tcp_nodelay",        tcp_nodelay, 1),
   FTPFS_OPT("connect_timeout=%u", connect_timeout, 0),
@@ -146,6 +168,12 @@ static void ftpfs_usage(const char *progname) {
 "    utf8                try to transfer file list with utf-8 encoding\n"
 "    codepage=STR        set the codepage the server uses\n"
 "    iocharset=STR       set the charset used by the client\n"
+"    upload_verify=STR   [size/none/list] how to check finished uploads\n"
+"    list_dialect=STR    [auto/unix/dos/netware] format of directory listings\n"
+"    list_threads=N      extra threads parsing big directory listings\n"
+"    control=PATH        take commands on a Unix domain socket at PATH\n"
+"    keepalive=SECS      send NOOP on connections idle for SECS\n"
+"    warm_connections=N  keep N connections logged in for uploads\n"
 "\n"
 "CurlFtpFS cache options:  \n"
 "    cache=yes|no              enable/disable cache (default: yes)\n"
@@ -154,7 +182,13 @@ static void ftpfs_usage(const char *progname) {
 "    cache_stat_timeout=SECS   set stat timeout\n"
 "    cache_dir_timeout=SECS    set dir timeout\n"
 "    cache_link_timeout=SECS   set link timeout\n"
-"\n", progname, DEFAULT_CACHE_TIMEOUT);
+"    cache_max_stale=SECS      serve expired entries for up to SECS while\n"
+"                              refreshing them in the background (default: 0)\n"
+"    cache_max_entries=N       keep at most N entries in the cache\n"
+"                              (default: %d, 0 for no limit)\n"
+"    cache_max_bytes=N         keep at most about N bytes of cache entries\n"
+"                              (default: 0 for no limit)\n"
+"\n", progname, DEFAULT_CACHE_TIMEOUT, DEFAULT_CACHE_MAX_ENTRIES);
 }
 
 static int ftpfs_fuse_main(struct fuse_args *args) {
@@ -243,6 +277,9 @@ int main(int argc, char** argv) {
   ftpfs.blksize      = 4096;
   ftpfs.disable_epsv = 1;
   ftpfs.multiconn    = 1;
+  ftpfs.upload_verify = UPLOAD_VERIFY_SIZE;
+  ftpfs.list_threads = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+  if (ftpfs.list_threads < 0) ftpfs.list_threads = 0;
   ftpfs.attached_to_multi = 0;
 
   if (fuse_opt_parse(&args, &ftpfs, ftpfs_opts, ftpfs_opt_proc) == -1)
@@ -262,6 +299,19 @@ int main(int argc, char** argv) {
     convert_charsets(ftpfs.iocharset, ftpfs.codepage, &ftpfs.host);
   }
 
+  /* The daemon runs from /, the socket is made once it is one */
+  if (ftpfs.control && ftpfs.control[0] != '/') {
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+      perror("getcwd");
+      return 1;
+    }
+    tmp = g_strdup_printf("%s/%s", cwd, ftpfs.control);
+    free(ftpfs.control);
+    ftpfs.control = strdup(tmp);
+    g_free(tmp);
+  }
+
   easy = curl_easy_init();
   if (easy == NULL) {
     fprintf(stderr, "Error initializing libcurl\n");
@@ -306,14 +356,35 @@ int main(int argc, char** argv) {
   }
 
   ftpfs.connection = easy;
+  stats_add(STATS_CONNECTIONS, 1);
   pthread_mutex_init(&ftpfs.lock, NULL);
 
+  /* Let the kernel keep lookups and attributes for a part of the time we
+     cache them, so that it adds little to how stale they can get. Options
+     given by the user still take precedence. */
+  if (cache_enabled()) {
+    unsigned timeout = cache_stat_timeout() / KERNEL_TIMEOUT_DIVISOR;
+    if (timeout == 0 && cache_stat_timeout() > 0)
+      timeout = 1;
+    /* invalidate on the control socket can only clear our cache, so keep
+       what the kernel holds short enough for it to be taken at its word */
+    if (ftpfs.control && timeout > CONTROL_KERNEL_TIMEOUT)
+      timeout = CONTROL_KERNEL_TIMEOUT;
+    tmp = g_strdup_printf("-oentry_timeout=%u,attr_timeout=%u",
+                          timeout, timeout);
+    fuse_opt_insert_arg(&args, 1, tmp);
+    g_free(tmp);
+  }
+
   /* Set the filesystem name to show the current server */
   tmp = g_strdup_printf("-ofsname=curlftpfs#%s", ftpfs.host);
   fuse_opt_insert_arg(&args, 1, tmp);
   g_free(tmp);
 
   res = ftpfs_fuse_main(&args);
+  control_stop();
+  stop_keepalive();
+  ftpfs_log_stop();
 
   cancel_previous_multi();
   curl_multi_cleanup(ftpfs.multi);
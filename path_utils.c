@@ -14,129 +14,194 @@
 #include "charset_utils.h"
 #include "ftpfs.h"
 
-#include <limits.h>
 #include <ctype.h>
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include <glib.h>
 
+/* The same paths are turned into URLs over and over, so every thread
+ * remembers the last URLs it built, and builds new ones in buffers it
+ * reuses. A hit costs one allocation, for the copy handed to the caller. */
+#define URL_MEMO_SIZE 64
+
+enum url_kind {
+  URL_FILE_NAME,
+  URL_FULL_PATH,
+  URL_FULLDIR_PATH,
+  URL_DIR_PATH
+};
+
+struct url_memo_entry {
+  enum url_kind kind;
+  char *path;
+  char *url;
+  size_t url_len;
+};
+
+struct url_memo {
+  struct url_memo_entry entries[URL_MEMO_SIZE];
+  const char *host;
+  const char *codepage;
+  GString *raw;
+  GString *encoded;
+};
+
+static pthread_key_t url_memo_key;
+static pthread_once_t url_memo_once = PTHREAD_ONCE_INIT;
+
+static void url_memo_clear(struct url_memo *memo) {
+  int i;
+
+  for (i = 0; i < URL_MEMO_SIZE; i++) {
+    g_free(memo->entries[i].path);
+    g_free(memo->entries[i].url);
+    memo->entries[i].path = memo->entries[i].url = NULL;
+  }
+}
+
+static void url_memo_free(void *data) {
+  struct url_memo *memo = data;
+
+  url_memo_clear(memo);
+  g_string_free(memo->raw, TRUE);
+  g_string_free(memo->encoded, TRUE);
+  g_free(memo);
+}
+
+static void url_memo_key_create(void) {
+  pthread_key_create(&url_memo_key, url_memo_free);
+}
+
+static struct url_memo *url_memo_get(void) {
+  struct url_memo *memo;
+
+  pthread_once(&url_memo_once, url_memo_key_create);
+  memo = pthread_getspecific(url_memo_key);
+  if (memo == NULL) {
+    memo = g_new0(struct url_memo, 1);
+    memo->raw = g_string_sized_new(256);
+    memo->encoded = g_string_sized_new(768);
+    pthread_setspecific(url_memo_key, memo);
+  }
+  /* The URLs depend on the host and codepage as well as on the path */
+  if (memo->host != ftpfs.host || memo->codepage != ftpfs.codepage) {
+    url_memo_clear(memo);
+    memo->host = ftpfs.host;
+    memo->codepage = ftpfs.codepage;
+  }
+  return memo;
+}
+
 /* Converts an integer value to its hex character*/
 char to_hex(char code) {
   static char hex[] = "0123456789abcdef";
   return hex[code & 15];
 }
 
-/* Returns a url-encoded version of str */
-/* IMPORTANT: be sure to free() the returned string after use */
-char *url_encode(char *str) {
-  char *pstr = str, *buf = malloc(strlen(str) * 3 + 1), *pbuf = buf;
+/* Appends a url-encoded version of str to buf */
+static void url_encode(GString *buf, const char *str) {
+  const char *pstr = str;
   while (*pstr) {
     if (isalnum(*pstr) || *pstr == '-' || *pstr == '_' || *pstr == '.' || *pstr == '~'
-      || *pstr == ':' || *pstr == '/')
-      *pbuf++ = *pstr;
-    else
-      *pbuf++ = '%', *pbuf++ = to_hex(*pstr >> 4), *pbuf++ = to_hex(*pstr & 15);
+      || *pstr == ':' || *pstr == '/') {
+      g_string_append_c(buf, *pstr);
+    } else {
+      g_string_append_c(buf, '%');
+      g_string_append_c(buf, to_hex(*pstr >> 4));
+      g_string_append_c(buf, to_hex(*pstr & 15));
+    }
     pstr++;
   }
-  *pbuf = '\0';
-  return buf;
 }
 
-char* get_file_name(const char* path) {
-  char *ret, *encoded;
-  const char* filename = strrchr(path, '/');
-  if (filename == NULL) filename = path;
-  else ++filename;
-
-  ret = strdup(filename);
-  if (ftpfs.codepage) {
-    convert_charsets(ftpfs.iocharset, ftpfs.codepage, &ret);
-  }
-
-  encoded = url_encode(ret);
-  free(ret);
+/* Appends len bytes of path to buf, in the server's codepage */
+static void append_converted(GString *buf, const char *path, size_t len) {
+  char *converted;
 
-  return encoded;
+  if (!ftpfs.codepage || !len ||
+      charset_passthrough(ftpfs.iocharset, ftpfs.codepage, path)) {
+    g_string_append_len(buf, path, len);
+    return;
+  }
+  converted = g_strndup(path, len);
+  convert_charsets(ftpfs.iocharset, ftpfs.codepage, &converted);
+  g_string_append(buf, converted);
+  free(converted);
 }
 
-char* get_full_path(const char* path) {
-  char *ret, *encoded;
-  char* converted_path = NULL;
-
-  ++path;
-
-  if (ftpfs.codepage && strlen(path)) {
-    converted_path = strdup(path);
-    convert_charsets(ftpfs.iocharset, ftpfs.codepage, &converted_path);
-    path = converted_path;
+/* Builds the unencoded URL of the given kind for path into buf */
+static void build_url(GString *buf, enum url_kind kind, const char *path) {
+  const char *lastdir;
+  size_t len;
+
+  g_string_truncate(buf, 0);
+  switch (kind) {
+    case URL_FILE_NAME:
+      lastdir = strrchr(path, '/');
+      path = lastdir ? lastdir + 1 : path;
+      append_converted(buf, path, strlen(path));
+      break;
+    case URL_FULL_PATH:
+      g_string_append(buf, ftpfs.host);
+      append_converted(buf, path + 1, strlen(path + 1));
+      break;
+    case URL_FULLDIR_PATH:
+      g_string_append(buf, ftpfs.host);
+      len = buf->len;
+      append_converted(buf, path + 1, strlen(path + 1));
+      if (buf->len > len) g_string_append_c(buf, '/');
+      break;
+    case URL_DIR_PATH:
+      ++path;
+      lastdir = strrchr(path, '/');
+      g_string_append(buf, ftpfs.host);
+      if (lastdir != NULL && lastdir != path) {
+        len = buf->len;
+        append_converted(buf, path, lastdir - path);
+        if (buf->len > len) g_string_append_c(buf, '/');
+      }
+      break;
   }
-
-  ret = g_strdup_printf("%s%s", ftpfs.host, path);
-
-  free(converted_path);
-
-  encoded = url_encode(ret);
-  free(ret);
-
-  return encoded;
 }
 
-char* get_fulldir_path(const char* path) {
-  char *ret, *encoded;
-  char* converted_path = NULL;
-
-  ++path;
-
-  if (ftpfs.codepage && strlen(path)) {
-    converted_path = strdup(path);
-    convert_charsets(ftpfs.iocharset, ftpfs.codepage, &converted_path);
-    path = converted_path;
+/* Returns the URL of the given kind for path, to be free()d by the caller */
+static char *get_url(enum url_kind kind, const char *path) {
+  struct url_memo *memo = url_memo_get();
+  struct url_memo_entry *entry =
+    &memo->entries[(g_str_hash(path) + kind) % URL_MEMO_SIZE];
+  char *ret;
+
+  if (entry->path == NULL || entry->kind != kind || strcmp(entry->path, path)) {
+    build_url(memo->raw, kind, path);
+    g_string_truncate(memo->encoded, 0);
+    url_encode(memo->encoded, memo->raw->str);
+
+    g_free(entry->path);
+    g_free(entry->url);
+    entry->kind = kind;
+    entry->path = g_strdup(path);
+    entry->url = g_strndup(memo->encoded->str, memo->encoded->len);
+    entry->url_len = memo->encoded->len;
   }
 
-  ret = g_strdup_printf("%s%s%s", ftpfs.host, path, strlen(path) ? "/" : "");
+  ret = malloc(entry->url_len + 1);
+  if (ret != NULL) memcpy(ret, entry->url, entry->url_len + 1);
+  return ret;
+}
 
-  free(converted_path);
+char* get_file_name(const char* path) {
+  return get_url(URL_FILE_NAME, path);
+}
 
-  encoded = url_encode(ret);
-  free(ret);
+char* get_full_path(const char* path) {
+  return get_url(URL_FULL_PATH, path);
+}
 
-  return encoded;
+char* get_fulldir_path(const char* path) {
+  return get_url(URL_FULLDIR_PATH, path);
 }
 
 char* get_dir_path(const char* path) {
-  char *ret, *encoded;
-  char* converted_path = NULL;
-  const char *lastdir;
-  size_t lastdir_off;
-
-  ++path;
-
-  lastdir = strrchr(path, '/');
-  if (lastdir == NULL) {
-   lastdir = path;
-   lastdir_off = 0;
-  } else {
-   lastdir_off = lastdir - path;
-  }
-
-  if (ftpfs.codepage && lastdir_off) {
-    converted_path = g_strndup(path, lastdir_off);
-    convert_charsets(ftpfs.iocharset, ftpfs.codepage, &converted_path);
-    path = converted_path;
-    lastdir_off = strlen(path);
-    lastdir = path + lastdir_off;
-  }
-
-  ret = g_strdup_printf("%s%.*s%s",
-                        ftpfs.host,
-                        lastdir_off > INT_MAX ? INT_MAX : ((int) lastdir_off),
-                        path,
-                        lastdir_off ? "/" : "");
-
-  free(converted_path);
-
-  encoded = url_encode(ret);
-  free(ret);
-
-  return encoded;
+  return get_url(URL_DIR_PATH, path);
 }
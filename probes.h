@@ -0,0 +1,35 @@
+#ifndef __CURLFTPFS_PROBES_H__
+#define __CURLFTPFS_PROBES_H__ 1
+
+/*
+    FTP file system
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+/* USDT probes of the curlftpfs provider, for SystemTap, bpftrace or perf.
+   Where sys/sdt.h is available a probe is a single nop with a note telling
+   tracers where its arguments are, which is why they are only ever plain
+   values already at hand. Without it, probes compile to nothing.
+
+     op_entry(op, path)             a FUSE operation starts
+     op_return(op, path, ret)       and returns ret
+     cache_hit(path, what)          what is "attr", "link" or "dir"
+     cache_miss(path, what)
+     read_start(path, offset)       a RETR is started to serve a read
+     read_restart(path, offset)     the same, at an offset
+     upload_chunk(path, len, left)  the upload takes len buffered bytes
+     parse_dir_start(dir)           a listing starts being parsed
+     parse_dir_done(dir, bytes)     and has been parsed in full */
+
+#include "config.h"
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define PROBE(name, ...) STAP_PROBEV(curlftpfs, name, __VA_ARGS__)
+#else
+#define PROBE(name, ...) do { } while (0)
+#endif
+
+#endif
@@ -0,0 +1,227 @@
+/*
+    FTP file system
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <glib.h>
+
+#include "cache.h"
+#include "stats.h"
+
+static unsigned long long counters[STATS_COUNTERS];
+
+static const char *names[STATS_COUNTERS] = {
+  [STATS_LIST]          = "list_transfers",
+  [STATS_RETR]          = "retr_transfers",
+  [STATS_STOR]          = "stor_transfers",
+  [STATS_COMMANDS]      = "other_commands",
+  [STATS_READ_RESTARTS] = "read_restarts",
+  [STATS_BYTES_DOWN]    = "bytes_downloaded",
+  [STATS_BYTES_UP]      = "bytes_uploaded",
+  [STATS_CONNECTIONS]   = "connections",
+  [STATS_UPLOADS]       = "uploads_in_flight",
+};
+
+static const char *histogram_names[STATS_HISTOGRAMS] = {
+  [STATS_OP_GETATTR]          = "op_getattr",
+  [STATS_OP_READLINK]         = "op_readlink",
+  [STATS_OP_GETDIR]           = "op_getdir",
+  [STATS_OP_MKNOD]            = "op_mknod",
+  [STATS_OP_MKDIR]            = "op_mkdir",
+  [STATS_OP_UNLINK]           = "op_unlink",
+  [STATS_OP_RMDIR]            = "op_rmdir",
+  [STATS_OP_RENAME]           = "op_rename",
+  [STATS_OP_CHMOD]            = "op_chmod",
+  [STATS_OP_CHOWN]            = "op_chown",
+  [STATS_OP_TRUNCATE]         = "op_truncate",
+  [STATS_OP_UTIME]            = "op_utime",
+  [STATS_OP_OPEN]             = "op_open",
+  [STATS_OP_READ]             = "op_read",
+  [STATS_OP_WRITE]            = "op_write",
+  [STATS_OP_STATFS]           = "op_statfs",
+  [STATS_OP_FLUSH]            = "op_flush",
+  [STATS_OP_RELEASE]          = "op_release",
+  [STATS_OP_FSYNC]            = "op_fsync",
+  [STATS_OP_CREATE]           = "op_create",
+  [STATS_OP_FTRUNCATE]        = "op_ftruncate",
+  [STATS_XFER_LIST]           = "xfer_list",
+  [STATS_XFER_RETR]           = "xfer_retr",
+  [STATS_XFER_STOR]           = "xfer_stor",
+  [STATS_XFER_COMMAND]        = "xfer_command",
+  [STATS_PHASE_NAMELOOKUP]    = "phase_namelookup",
+  [STATS_PHASE_CONNECT]       = "phase_connect",
+  [STATS_PHASE_APPCONNECT]    = "phase_appconnect",
+  [STATS_PHASE_PRETRANSFER]   = "phase_pretransfer",
+  [STATS_PHASE_STARTTRANSFER] = "phase_starttransfer",
+  [STATS_PHASE_TRANSFER]      = "phase_transfer",
+};
+
+/* Every thread records latencies in its own histograms, with plain loads
+ * and stores as nobody else writes to them. Readers sum up the histograms
+ * of all threads, those of exited threads having been folded into
+ * retired. */
+struct stats_histograms {
+  unsigned long long count[STATS_HISTOGRAMS][STATS_BUCKETS];
+  unsigned long long sum[STATS_HISTOGRAMS];
+  struct stats_histograms *next;
+};
+
+static struct stats_histograms *threads;
+static struct stats_histograms retired;
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t threads_key;
+static pthread_once_t threads_once = PTHREAD_ONCE_INIT;
+
+static void stats_thread_exit(void *data) {
+  struct stats_histograms *h = data, **p;
+  int i, j;
+
+  pthread_mutex_lock(&threads_lock);
+  for (p = &threads; *p != h; p = &(*p)->next);
+  *p = h->next;
+  for (i = 0; i < STATS_HISTOGRAMS; i++) {
+    for (j = 0; j < STATS_BUCKETS; j++)
+      retired.count[i][j] += h->count[i][j];
+    retired.sum[i] += h->sum[i];
+  }
+  pthread_mutex_unlock(&threads_lock);
+  free(h);
+}
+
+static void stats_key_create(void) {
+  pthread_key_create(&threads_key, stats_thread_exit);
+}
+
+static struct stats_histograms *stats_thread(void) {
+  struct stats_histograms *h;
+
+  pthread_once(&threads_once, stats_key_create);
+  h = pthread_getspecific(threads_key);
+  if (h == NULL) {
+    h = calloc(1, sizeof(*h));
+    if (h == NULL) return NULL;
+    pthread_mutex_lock(&threads_lock);
+    h->next = threads;
+    threads = h;
+    pthread_mutex_unlock(&threads_lock);
+    pthread_setspecific(threads_key, h);
+  }
+  return h;
+}
+
+static void stats_bump(unsigned long long *x, unsigned long long n) {
+  __atomic_store_n(x, __atomic_load_n(x, __ATOMIC_RELAXED) + n,
+                   __ATOMIC_RELAXED);
+}
+
+uint64_t stats_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void stats_time(enum stats_histogram histogram, uint64_t start) {
+  stats_record(histogram, stats_clock() - start);
+}
+
+void stats_record(enum stats_histogram histogram, uint64_t usec) {
+  struct stats_histograms *h = stats_thread();
+  int bucket = 0;
+
+  if (h == NULL) return;
+  /* Bucket b holds latencies below 2^b microseconds */
+  while (bucket < STATS_BUCKETS - 1 && usec >> bucket)
+    bucket++;
+  stats_bump(&h->count[histogram][bucket], 1);
+  stats_bump(&h->sum[histogram], usec);
+}
+
+void stats_add(enum stats_counter counter, long long n) {
+  __sync_fetch_and_add(&counters[counter], n);
+}
+
+unsigned long long stats_get(enum stats_counter counter) {
+  return __sync_fetch_and_add(&counters[counter], 0);
+}
+
+char *stats_format(void) {
+  struct cache_stats cache;
+  GString *out = g_string_sized_new(512);
+  int i;
+
+  cache_get_stats(&cache);
+  g_string_append_printf(out, "cache_hits %llu\n", cache.hits);
+  g_string_append_printf(out, "cache_misses %llu\n", cache.misses);
+  g_string_append_printf(out, "cache_evictions %llu\n", cache.evictions);
+  g_string_append_printf(out, "cache_entries %lu\n", cache.entries);
+  g_string_append_printf(out, "cache_bytes %llu\n", cache.bytes);
+
+  for (i = 0; i < STATS_COUNTERS; i++) {
+    g_string_append_printf(out, "%s %llu\n", names[i],
+                           stats_get((enum stats_counter) i));
+  }
+
+  return g_string_free(out, FALSE);
+}
+
+/* Returns the upper bound of the bucket holding the given fraction of the
+ * recorded latencies */
+static unsigned long long stats_percentile(const unsigned long long *count,
+                                           unsigned long long total,
+                                           double fraction) {
+  unsigned long long seen = 0;
+  int i;
+
+  for (i = 0; i < STATS_BUCKETS; i++) {
+    seen += count[i];
+    if (seen && seen >= total * fraction) break;
+  }
+  return 1ULL << (i < STATS_BUCKETS ? i : STATS_BUCKETS - 1);
+}
+
+char *stats_format_latency(void) {
+  struct stats_histograms *sum = g_new(struct stats_histograms, 1);
+  struct stats_histograms *h;
+  GString *out = g_string_sized_new(4096);
+  int i, j;
+
+  pthread_mutex_lock(&threads_lock);
+  *sum = retired;
+  for (h = threads; h != NULL; h = h->next) {
+    for (i = 0; i < STATS_HISTOGRAMS; i++) {
+      for (j = 0; j < STATS_BUCKETS; j++)
+        sum->count[i][j] += __atomic_load_n(&h->count[i][j], __ATOMIC_RELAXED);
+      sum->sum[i] += __atomic_load_n(&h->sum[i], __ATOMIC_RELAXED);
+    }
+  }
+  pthread_mutex_unlock(&threads_lock);
+
+  for (i = 0; i < STATS_HISTOGRAMS; i++) {
+    unsigned long long total = 0;
+    int last = 0;
+
+    for (j = 0; j < STATS_BUCKETS; j++) {
+      total += sum->count[i][j];
+      if (sum->count[i][j]) last = j;
+    }
+    if (!total) continue;
+
+    g_string_append_printf(out,
+        "%s count=%llu sum_us=%llu p50_us=%llu p90_us=%llu p99_us=%llu "
+        "buckets=", histogram_names[i], total, sum->sum[i],
+        stats_percentile(sum->count[i], total, 0.5),
+        stats_percentile(sum->count[i], total, 0.9),
+        stats_percentile(sum->count[i], total, 0.99));
+    for (j = 0; j <= last; j++)
+      g_string_append_printf(out, "%s%llu", j ? "," : "", sum->count[i][j]);
+    g_string_append_c(out, '\n');
+  }
+
+  g_free(sum);
+  return g_string_free(out, FALSE);
+}
@@ -0,0 +1,88 @@
+#ifndef __CURLFTPFS_STATS_H__
+#define __CURLFTPFS_STATS_H__ 1
+
+/*
+    FTP file system
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+#include <stdint.h>
+
+/* Paths of the synthesized statistics, hidden from directory listings */
+#define STATS_DIR          "/.curlftpfs"
+#define STATS_FILE         STATS_DIR "/stats"
+#define STATS_LATENCY_FILE STATS_DIR "/latency"
+
+enum stats_counter {
+  STATS_LIST,             /* LIST transfers */
+  STATS_RETR,             /* RETR transfers */
+  STATS_STOR,             /* STOR and APPE transfers */
+  STATS_COMMANDS,         /* other commands, like SIZE, DELE or SITE CHMOD */
+  STATS_READ_RESTARTS,    /* RETR restarted at an offset to serve a read */
+  STATS_BYTES_DOWN,
+  STATS_BYTES_UP,
+  STATS_CONNECTIONS,      /* curl handles, each with its own connection */
+  STATS_UPLOADS,          /* streaming uploads in flight */
+  STATS_COUNTERS
+};
+
+/* Latencies recorded in log2 buckets of microseconds */
+enum stats_histogram {
+  /* FUSE operations */
+  STATS_OP_GETATTR,
+  STATS_OP_READLINK,
+  STATS_OP_GETDIR,
+  STATS_OP_MKNOD,
+  STATS_OP_MKDIR,
+  STATS_OP_UNLINK,
+  STATS_OP_RMDIR,
+  STATS_OP_RENAME,
+  STATS_OP_CHMOD,
+  STATS_OP_CHOWN,
+  STATS_OP_TRUNCATE,
+  STATS_OP_UTIME,
+  STATS_OP_OPEN,
+  STATS_OP_READ,
+  STATS_OP_WRITE,
+  STATS_OP_STATFS,
+  STATS_OP_FLUSH,
+  STATS_OP_RELEASE,
+  STATS_OP_FSYNC,
+  STATS_OP_CREATE,
+  STATS_OP_FTRUNCATE,
+  /* Whole curl transfers */
+  STATS_XFER_LIST,
+  STATS_XFER_RETR,
+  STATS_XFER_STOR,
+  STATS_XFER_COMMAND,
+  /* Where the time of a transfer went, phase by phase */
+  STATS_PHASE_NAMELOOKUP,    /* resolving the host name */
+  STATS_PHASE_CONNECT,       /* TCP connect */
+  STATS_PHASE_APPCONNECT,    /* TLS handshake */
+  STATS_PHASE_PRETRANSFER,   /* login, CWD, PASV/EPSV and the data connection */
+  STATS_PHASE_STARTTRANSFER, /* waiting for the server's first byte */
+  STATS_PHASE_TRANSFER,      /* moving the data */
+  STATS_HISTOGRAMS
+};
+
+#define STATS_BUCKETS 32
+
+void stats_add(enum stats_counter counter, long long n);
+unsigned long long stats_get(enum stats_counter counter);
+
+/* Returns a timestamp to pass to stats_time() later */
+uint64_t stats_clock(void);
+/* Records the time elapsed since start */
+void stats_time(enum stats_histogram histogram, uint64_t start);
+/* Records a latency measured elsewhere */
+void stats_record(enum stats_histogram histogram, uint64_t usec);
+
+/* Returns the statistics as "name value" lines, to be g_free()d */
+char *stats_format(void);
+/* Returns one line per histogram with its count, sum, percentiles and
+ * buckets, to be g_free()d */
+char *stats_format_latency(void);
+
+#endif
@@ -0,0 +1,181 @@
+/*
+    Caching file system proxy
+    Copyright (C) 2004  Miklos Szeredi <miklos@szeredi.hu>
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+/* Measures how cache hits scale with the number of threads doing lookups
+   concurrently, over paths spread across many directories and over paths
+   all in one directory, and how much memory a cached entry takes.
+
+   usage: cache_bench [max_threads [seconds_per_run]] */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "cache.h"
+
+#define NPATHS 8192
+#define NMEM 200000
+
+static struct fuse_operations *oper;
+static char *spread_paths[NPATHS];
+static char *hot_paths[NPATHS];
+static char **paths;
+static volatile int stop;
+
+static int dummy_getattr(const char *path, struct stat *sbuf)
+{
+  (void) path;
+  memset(sbuf, 0, sizeof(*sbuf));
+  sbuf->st_mode = S_IFREG | 0644;
+  sbuf->st_size = 42;
+  return 0;
+}
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *lookup_thread(void *data)
+{
+  unsigned long long *ops = data;
+  unsigned seed = (unsigned) (size_t) data;
+  struct stat sbuf;
+
+  while (!stop) {
+    int i;
+    for (i = 0; i < 1024; i++) {
+      seed = seed * 1103515245 + 12345;
+      if (oper->getattr(paths[(seed >> 8) % NPATHS], &sbuf) != 0)
+        abort();
+    }
+    *ops += 1024;
+  }
+  return NULL;
+}
+
+static void run(int nthreads, double seconds)
+{
+  pthread_t threads[256];
+  unsigned long long ops[256];
+  unsigned long long total = 0;
+  double start, elapsed;
+  int i;
+
+  stop = 0;
+  memset(ops, 0, sizeof(ops));
+  start = now();
+  for (i = 0; i < nthreads; i++)
+    pthread_create(&threads[i], NULL, lookup_thread, &ops[i]);
+  usleep((useconds_t) (seconds * 1e6));
+  stop = 1;
+  for (i = 0; i < nthreads; i++) {
+    pthread_join(threads[i], NULL);
+    total += ops[i];
+  }
+  elapsed = now() - start;
+
+  printf("threads=%-3d lookups/s=%12.0f per-thread=%12.0f\n",
+         nthreads, total / elapsed, total / elapsed / nthreads);
+}
+
+/* Resident set size in bytes, or 0 if unknown */
+static long rss(void)
+{
+  long pages = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (f) {
+    if (fscanf(f, "%*ld %ld", &pages) != 1)
+      pages = 0;
+    fclose(f);
+  }
+  return pages * sysconf(_SC_PAGESIZE);
+}
+
+static void run_memory(void)
+{
+  struct stat sbuf;
+  long before;
+  int i;
+
+  memset(&sbuf, 0, sizeof(sbuf));
+  sbuf.st_mode = S_IFREG | 0644;
+  before = rss();
+  for (i = 0; i < NMEM; i++) {
+    char path[128];
+    snprintf(path, sizeof(path), "/pub/mirror/archive/%d/%d/file-%d.tar.gz",
+             i / 1000, i / 50, i);
+    sbuf.st_size = i;
+    cache_add_attr(path, &sbuf);
+  }
+  if (before)
+    printf("cached entries=%d bytes/entry=%.0f\n", NMEM,
+           (double) (rss() - before) / NMEM);
+}
+
+int main(int argc, char **argv) {
+  struct fuse_cache_operations dummy_oper;
+  char *bench_argv[] = { argv[0], "-ocache_timeout=3600,cache_max_entries=0" };
+  struct fuse_args args = FUSE_ARGS_INIT(2, bench_argv);
+  int max_threads = argc > 1 ? atoi(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+  double seconds = argc > 2 ? atof(argv[2]) : 1.0;
+  struct stat sbuf;
+  int i;
+
+  if (max_threads < 1)
+    max_threads = 1;
+  if (max_threads > 256)
+    max_threads = 256;
+
+  memset(&dummy_oper, 0, sizeof(dummy_oper));
+  dummy_oper.oper.getattr = dummy_getattr;
+  cache_parse_options(&args);
+  oper = cache_init(&dummy_oper);
+  assert(oper != NULL);
+
+  for (i = 0; i < NPATHS; i++) {
+    char path[64];
+    snprintf(path, sizeof(path), "/dir%d/subdir%d/file%d", i % 37, i % 101, i);
+    spread_paths[i] = strdup(path);
+    oper->getattr(spread_paths[i], &sbuf);
+    snprintf(path, sizeof(path), "/hot/file%d", i);
+    hot_paths[i] = strdup(path);
+    oper->getattr(hot_paths[i], &sbuf);
+  }
+
+  printf("cache lookup contention, %d cached paths in %d directories\n",
+         NPATHS, 37 * 101);
+  paths = spread_paths;
+  for (i = 1; i < max_threads; i *= 2)
+    run(i, seconds);
+  run(max_threads, seconds);
+
+  printf("cache lookup contention, %d cached paths in one directory\n",
+         NPATHS);
+  paths = hot_paths;
+  for (i = 1; i < max_threads; i *= 2)
+    run(i, seconds);
+  run(max_threads, seconds);
+  run_memory();
+
+  for (i = 0; i < NPATHS; i++) {
+    free(spread_paths[i]);
+    free(hot_paths[i]);
+  }
+  fuse_opt_free_args(&args);
+  cache_deinit();
+
+  return 0;
+}
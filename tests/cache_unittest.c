@@ -0,0 +1,379 @@
+/*
+    Caching file system proxy
+    Copyright (C) 2004  Miklos Szeredi <miklos@szeredi.hu>
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+#include <glib.h>
+
+#include "cache.h"
+
+static int getattr_calls;
+static pthread_mutex_t calls_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int dummy_getattr(const char *path, struct stat *sbuf)
+{
+  if (strcmp(path, "/file"))
+    return -ENOENT;
+
+  memset(sbuf, 0, sizeof(*sbuf));
+  sbuf->st_mode = S_IFREG | 0644;
+  pthread_mutex_lock(&calls_lock);
+  sbuf->st_size = ++getattr_calls;
+  pthread_mutex_unlock(&calls_lock);
+  return 0;
+}
+
+static int getdir_calls;
+
+static int dummy_getdir(const char *path, fuse_cache_dirh_t h,
+                        fuse_cache_dirfil_t filler)
+{
+  struct stat sbuf;
+
+  memset(&sbuf, 0, sizeof(sbuf));
+  sbuf.st_mode = S_IFREG | 0600;
+  if (!strcmp(path, "/big")) {
+    int i;
+    getdir_calls++;
+    for (i = 0; i < 40; i++) {
+      char name[16];
+      snprintf(name, sizeof(name), "big%d", i);
+      filler(h, name, &sbuf);
+    }
+    return 0;
+  }
+  if (strcmp(path, "/dir"))
+    return -ENOENT;
+
+  getdir_calls++;
+  sbuf.st_size = 10;
+  filler(h, "a", &sbuf);
+  sbuf.st_size = 20;
+  filler(h, "b", &sbuf);
+  return 0;
+}
+
+static int dummy_rename(const char *from, const char *to)
+{
+  (void) from;
+  (void) to;
+  return 0;
+}
+
+static int dummy_mkdir(const char *path, mode_t mode)
+{
+  (void) path;
+  (void) mode;
+  return 0;
+}
+
+static int dummy_unlink(const char *path)
+{
+  (void) path;
+  return 0;
+}
+
+static int dummy_create(const char *path, mode_t mode,
+                        struct fuse_file_info *fi)
+{
+  (void) path;
+  (void) mode;
+  (void) fi;
+  return 0;
+}
+
+static int dummy_write(const char *path, const char *buf, size_t size,
+                       off_t offset, struct fuse_file_info *fi)
+{
+  (void) path;
+  (void) buf;
+  (void) offset;
+  (void) fi;
+  return size;
+}
+
+static int dir_count;
+static int dir_with_stat;
+
+static int count_filler(void *buf, const char *name, const struct stat *stbuf,
+                        off_t off)
+{
+  (void) buf;
+  (void) off;
+  if (stbuf != NULL)
+    dir_with_stat++;
+  assert(!strcmp(name, "a") || !strcmp(name, "b") || !strcmp(name, "x") ||
+         !strcmp(name, "new") || !strcmp(name, "f") ||
+         !strncmp(name, "big", 3));
+  dir_count++;
+  return 0;
+}
+
+static int get_calls(void)
+{
+  int calls;
+  pthread_mutex_lock(&calls_lock);
+  calls = getattr_calls;
+  pthread_mutex_unlock(&calls_lock);
+  return calls;
+}
+
+static void wait_for_calls(int expected)
+{
+  int i;
+  for (i = 0; i < 200 && get_calls() < expected; i++)
+    usleep(10000);
+  assert(get_calls() == expected);
+}
+
+static int renaming;
+
+/* Keeps adding entries past cache_max_entries while main renames */
+static void *fill_thread(void *data)
+{
+  struct stat sbuf;
+  unsigned i;
+
+  (void) data;
+  memset(&sbuf, 0, sizeof(sbuf));
+  sbuf.st_mode = S_IFREG | 0644;
+  for (i = 0; __atomic_load_n(&renaming, __ATOMIC_RELAXED); i++) {
+    char path[32];
+    snprintf(path, sizeof(path), "/fill%u/f%u", i % 7, i);
+    cache_add_attr(path, &sbuf);
+  }
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  struct fuse_cache_operations dummy_oper;
+  struct fuse_operations *oper;
+  struct stat sbuf;
+  struct cache_stats stats;
+  unsigned long entries;
+  char **names;
+  int err, i;
+  char *test_argv[] = { argv[0], "-ocache_timeout=0,cache_dir_timeout=60,cache_max_stale=2,"
+                                   "cache_max_entries=32,cache_max_bytes=8589934592" };
+  struct fuse_args args = FUSE_ARGS_INIT(2, test_argv);
+
+  (void) argc;
+
+  memset(&dummy_oper, 0, sizeof(dummy_oper));
+  dummy_oper.oper.getattr = dummy_getattr;
+  dummy_oper.oper.rename = dummy_rename;
+  dummy_oper.oper.mkdir = dummy_mkdir;
+  dummy_oper.oper.unlink = dummy_unlink;
+  dummy_oper.oper.create = dummy_create;
+  dummy_oper.oper.write = dummy_write;
+  dummy_oper.cache_getdir = dummy_getdir;
+
+  err = cache_parse_options(&args);
+  assert(err == 0);
+  oper = cache_init(&dummy_oper);
+  assert(oper != NULL);
+
+  /* First access goes to the server */
+  err = oper->getattr("/file", &sbuf);
+  assert(err == 0);
+  assert(sbuf.st_size == 1);
+  assert(get_calls() == 1);
+
+  /* Expired, but within cache_max_stale: the stale entry is returned right
+     away and refreshed in the background */
+  sleep(1);
+  err = oper->getattr("/file", &sbuf);
+  assert(err == 0);
+  assert(sbuf.st_size == 1);
+  wait_for_calls(2);
+
+  for (i = 0; i < 20; i++) {
+    char path[32];
+    snprintf(path, sizeof(path), "/exp/f%d", i);
+    cache_add_attr(path, &sbuf);
+  }
+  cache_get_stats(&stats);
+  entries = stats.entries;
+
+  /* Past cache_max_stale, the lookup has to wait for the server */
+  sleep(4);
+  err = oper->getattr("/file", &sbuf);
+  assert(err == 0);
+  assert(sbuf.st_size == 3);
+  assert(get_calls() == 3);
+
+  /* Expired entries are reclaimed as new ones are added next to them */
+  cache_add_attr("/exp/new", &sbuf);
+  cache_get_stats(&stats);
+  assert(stats.entries == entries - 20 + 1);
+
+  err = oper->getattr("/missing", &sbuf);
+  assert(err == -ENOENT);
+  err = oper->getattr("/missing", &sbuf);
+  assert(err == -ENOENT);
+  assert(get_calls() == 3);
+
+  /* Listing a directory caches both the names and the attributes of its
+     entries */
+  err = oper->readdir("/dir", NULL, count_filler, 0, NULL);
+  assert(err == 0);
+  assert(dir_count == 2);
+  err = oper->getattr("/dir/b", &sbuf);
+  assert(err == 0);
+  assert(sbuf.st_size == 20);
+  assert(sbuf.st_mtime == sbuf.st_atime);
+  assert(get_calls() == 3);
+  err = oper->readdir("/dir", NULL, count_filler, 0, NULL);
+  assert(err == 0);
+  assert(dir_count == 4);
+  assert(getdir_calls == 1);
+  /* Both from the server and from the cache, the entries come with their
+     attributes */
+  assert(dir_with_stat == 4);
+
+  /* Renaming a directory moves everything cached below it */
+  sbuf.st_size = 42;
+  cache_add_attr("/d1", &sbuf);
+  cache_add_attr("/d1/sub/x", &sbuf);
+  names = g_new0(char *, 2);
+  names[0] = g_strdup("x");
+  cache_add_dir("/d1/sub", names);
+  err = oper->rename("/d1", "/d2");
+  assert(err == 0);
+  err = oper->getattr("/d2/sub/x", &sbuf);
+  assert(err == 0);
+  assert(sbuf.st_size == 42);
+  err = oper->getattr("/d1/sub/x", &sbuf);
+  assert(err == -ENOENT);
+  dir_count = 0;
+  err = oper->readdir("/d2/sub", NULL, count_filler, 0, NULL);
+  assert(err == 0);
+  assert(dir_count == 1);
+  assert(getdir_calls == 1);
+
+  /* Known outcomes of changes are written through to the cached listings
+     instead of listing the directories again */
+  err = oper->mkdir("/dir/new", 0755);
+  assert(err == 0);
+  err = oper->create("/dir/new/f", 0644, NULL);
+  assert(err == 0);
+  err = oper->write("/dir/new/f", "hello", 5, 0, NULL);
+  assert(err == 5);
+  err = oper->getattr("/dir/new/f", &sbuf);
+  assert(err == 0);
+  assert(S_ISREG(sbuf.st_mode) && sbuf.st_size == 5);
+  err = oper->unlink("/dir/a");
+  assert(err == 0);
+  dir_count = 0;
+  err = oper->readdir("/dir", NULL, count_filler, 0, NULL);
+  assert(err == 0);
+  assert(dir_count == 2);     /* b and new */
+  dir_count = 0;
+  err = oper->readdir("/dir/new", NULL, count_filler, 0, NULL);
+  assert(err == 0);
+  assert(dir_count == 1);
+  assert(getdir_calls == 1);
+  assert(get_calls() == 3);
+
+  /* Going over cache_max_entries evicts what wasn't used recently */
+  for (i = 0; i < 40; i++) {
+    char path[32];
+    snprintf(path, sizeof(path), "/other%d", i);
+    cache_add_attr(path, &sbuf);
+  }
+  cache_get_stats(&stats);
+  assert(stats.entries <= 32);
+  assert(stats.evictions >= 8);
+  assert(stats.hits > 0 && stats.misses > 0);
+
+  /* A forgotten directory is listed again, here ahead of time */
+  cache_forget("/dir", 1);
+  err = cache_prefetch("/dir", 1, NULL);
+  assert(err == 1);
+  assert(getdir_calls == 2);
+  dir_count = 0;
+  err = oper->readdir("/dir", NULL, count_filler, 0, NULL);
+  assert(err == 0);
+  assert(dir_count == 2);     /* a and b again */
+  assert(getdir_calls == 2);
+  err = cache_prefetch("/missing", 1, NULL);
+  assert(err == -ENOENT);
+  i = 1;
+  err = cache_prefetch("/dir", 1, &i);
+  assert(err == -ECANCELED);
+  assert(getdir_calls == 2);
+
+  /* Limits lowered while mounted apply right away */
+  err = cache_set_option("cache_max_entries", 16);
+  assert(err == 0);
+  cache_get_stats(&stats);
+  assert(stats.entries <= 16);
+
+  /* A listing bigger than the cache is passed on without pushing the rest
+     out */
+  dir_count = 0;
+  err = oper->readdir("/dir", NULL, count_filler, 0, NULL);
+  assert(err == 0);
+  cache_get_stats(&stats);
+  entries = stats.evictions;
+  getdir_calls = 0;
+  for (i = 0; i < 2; i++) {
+    dir_count = 0;
+    err = oper->readdir("/big", NULL, count_filler, 0, NULL);
+    assert(err == 0);
+    assert(dir_count == 40);
+  }
+  assert(getdir_calls == 2);
+  cache_get_stats(&stats);
+  assert(stats.entries <= 16);
+  assert(stats.evictions == entries);
+  err = oper->readdir("/dir", NULL, count_filler, 0, NULL);
+  assert(err == 0);
+  assert(getdir_calls == 2);
+  assert(cache_set_option("cache_max_bytes", 5ULL << 30) == 0);
+  assert(cache_set_option("cache_max_entries", 1ULL << 32) == -EINVAL);
+  assert(cache_set_option("cache", 0) == -EINVAL);
+  assert(cache_set_option("cache_max", 0) == -EINVAL);
+
+  /* Directories moved by a rename are never evicted through the shard they
+     were in */
+  {
+    pthread_t filler;
+    int j;
+
+    __atomic_store_n(&renaming, 1, __ATOMIC_RELAXED);
+    pthread_create(&filler, NULL, fill_thread, NULL);
+    for (i = 0; i < 500; i++) {
+      char from[32], to[32];
+      for (j = 0; j < 8; j++) {
+        char path[48];
+        snprintf(path, sizeof(path), "/ren%d/sub%d/f", i, j);
+        cache_add_attr(path, &sbuf);
+      }
+      snprintf(from, sizeof(from), "/ren%d", i);
+      snprintf(to, sizeof(to), "/ren%d", i + 1);
+      err = oper->rename(from, to);
+      assert(err == 0);
+    }
+    __atomic_store_n(&renaming, 0, __ATOMIC_RELAXED);
+    pthread_join(filler, NULL);
+    cache_get_stats(&stats);
+    assert(stats.entries <= 16);
+  }
+
+  fuse_opt_free_args(&args);
+
+  cache_deinit();
+
+  return 0;
+}
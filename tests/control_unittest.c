@@ -0,0 +1,124 @@
+/*
+    FTP file system
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "ftpfs.h"
+#include "control.h"
+
+struct ftpfs ftpfs;
+
+static int connect_to(const char *path) {
+  struct sockaddr_un addr;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+  assert(fd >= 0);
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  assert(connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0);
+  return fd;
+}
+
+/* Sends a command and returns its answer, up to its last line */
+static char *command(int fd, const char *cmd) {
+  static char reply[65536];
+  size_t len = 0;
+
+  assert(write(fd, cmd, strlen(cmd)) == (ssize_t) strlen(cmd));
+  for (;;) {
+    char *last;
+    ssize_t n = read(fd, reply + len, sizeof(reply) - len - 1);
+    assert(n > 0);
+    len += n;
+    reply[len] = '\0';
+    if (reply[len - 1] != '\n')
+      continue;
+    reply[len - 1] = '\0';
+    last = strrchr(reply, '\n');
+    reply[len - 1] = '\n';
+    last = last ? last + 1 : reply;
+    if (!strncmp(last, "ok", 2) || !strncmp(last, "error: ", 7))
+      return reply;
+  }
+}
+
+int main(int argc, char **argv) {
+  char path[64];
+  struct stat st;
+  char *reply;
+  int fd;
+
+  (void) argc;
+  (void) argv;
+
+  snprintf(path, sizeof(path), "/tmp/control_unittest.%d", (int) getpid());
+
+  /* Whatever else is at the path is not replaced */
+  fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+  assert(fd >= 0);
+  close(fd);
+  assert(control_start(path) == -EEXIST);
+  assert(stat(path, &st) == 0 && S_ISREG(st.st_mode));
+  unlink(path);
+
+  assert(control_start(path) == 0);
+  assert(stat(path, &st) == 0);
+  assert(S_ISSOCK(st.st_mode));
+  assert((st.st_mode & 077) == 0);
+
+  /* A second mount cannot take over a socket in use */
+  assert(control_start(path) == -EADDRINUSE);
+
+  fd = connect_to(path);
+
+  reply = command(fd, "set ftpfs_debug 2\n");
+  assert(!strcmp(reply, "ok\n"));
+  assert(ftpfs.debug == 2);
+  reply = command(fd, "set ftpfs_debug 0\r\n");
+  assert(!strcmp(reply, "ok\n"));
+  assert(ftpfs.debug == 0);
+  reply = command(fd, "set list_threads 3\n");
+  assert(!strcmp(reply, "ok\n"));
+  assert(ftpfs.list_threads == 3);
+  reply = command(fd, "set cache_timeout 30\n");
+  assert(!strcmp(reply, "ok\n"));
+  reply = command(fd, "set list_threads -1\n");
+  assert(!strncmp(reply, "error: ", 7));
+  reply = command(fd, "set nonsense 1\n");
+  assert(!strncmp(reply, "error: ", 7));
+
+  reply = command(fd, "invalidate-tree /some/dir/\n");
+  assert(!strcmp(reply, "ok\n"));
+  reply = command(fd, "invalidate relative\n");
+  assert(!strncmp(reply, "error: ", 7));
+  /* Nothing to prefetch into without a cache */
+  reply = command(fd, "prefetch 2 /some/dir\n");
+  assert(!strncmp(reply, "error: ", 7));
+
+  reply = command(fd, "stats\n");
+  assert(strstr(reply, "list_transfers 0\n") != NULL);
+  assert(strstr(reply, "\nok\n") != NULL);
+
+  reply = command(fd, "reboot\n");
+  assert(!strcmp(reply, "error: unknown command reboot\n"));
+
+  close(fd);
+  control_stop();
+  assert(stat(path, &st) == -1 && errno == ENOENT);
+
+  return 0;
+}
@@ -0,0 +1,245 @@
+#!/usr/bin/env python3
+#
+#   FTP file system
+#
+#   This program can be distributed under the terms of the GNU GPL.
+#   See the file COPYING.
+#
+# Mounts curlftpfs against ftpserver.py on loopback and measures scripted
+# workloads through the mount: cold and warm find, ls -l on a huge
+# directory, sequential and random reads, many small uploads and one large
+# upload. Every workload reports operations per second, p50/p99 latency of
+# its operations and the FTP commands the server saw.
+#
+# The server can emulate a slower link (see ftpserver.py), to show the round
+# trips and tail latencies loopback hides.
+#
+# usage: e2e_bench.py [--curlftpfs PATH] [-o OPTIONS] [--no-mount DIR]
+#                     [--rtt-ms MS] [--jitter-ms MS] [--bandwidth KB/s]
+#                     [--drop-rate P] [--seed N]
+
+import argparse
+import os
+import random
+import shutil
+import stat
+import subprocess
+import sys
+import tempfile
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import ftpserver  # noqa: E402
+
+CHUNK = 128 << 10
+
+
+class Result:
+    def __init__(self, name):
+        self.name = name
+        self.latencies = []
+        self.bytes = 0
+        self.elapsed = 0.0
+        self.commands = {}
+
+    def time(self, op, *args):
+        start = time.perf_counter()
+        ret = op(*args)
+        self.latencies.append(time.perf_counter() - start)
+        return ret
+
+    def percentile(self, p):
+        if not self.latencies:
+            return 0.0
+        ordered = sorted(self.latencies)
+        return ordered[min(len(ordered) - 1, int(len(ordered) * p / 100))]
+
+    def report(self):
+        ops = len(self.latencies)
+        line = "%-16s %7d ops %9.0f ops/s  p50 %8.3f ms  p99 %8.3f ms" % (
+            self.name, ops, ops / self.elapsed if self.elapsed else 0,
+            self.percentile(50) * 1e3, self.percentile(99) * 1e3)
+        if self.bytes:
+            line += "  %7.1f MB/s" % (self.bytes / self.elapsed / 1e6)
+        if self.commands:
+            drops = self.commands.pop("DROP", 0)
+            line += "  %d cmds (%s)" % (
+                sum(self.commands.values()),
+                " ".join("%s=%d" % c for c in sorted(
+                    self.commands.items(), key=lambda c: -c[1])[:4]))
+            if drops:
+                line += "  %d drops" % drops
+        return line
+
+
+def walk(result, path):
+    """What find does: list each directory, stat each entry."""
+    names = result.time(os.listdir, path)
+    for name in names:
+        full = os.path.join(path, name)
+        st = result.time(os.lstat, full)
+        if stat.S_ISDIR(st.st_mode):
+            walk(result, full)
+
+
+def find(result, mnt, args):
+    walk(result, os.path.join(mnt, "tree"))
+
+
+def ls_huge(result, mnt, args):
+    path = os.path.join(mnt, "huge")
+    for name in result.time(os.listdir, path):
+        result.time(os.lstat, os.path.join(path, name))
+
+
+def read_chunk(f, size):
+    data = f.read(size)
+    return len(data)
+
+
+def seq_read(result, mnt, args):
+    with open(os.path.join(mnt, "large"), "rb", buffering=0) as f:
+        while True:
+            n = result.time(read_chunk, f, CHUNK)
+            if not n:
+                break
+            result.bytes += n
+
+
+def rand_read(result, mnt, args):
+    path = os.path.join(mnt, "large")
+    size = os.path.getsize(path)
+    rng = random.Random(42)
+    fd = os.open(path, os.O_RDONLY)
+    try:
+        for _ in range(args.random_reads):
+            offset = rng.randrange(0, max(1, size - 4096)) & ~4095
+            result.bytes += len(result.time(os.pread, fd, 4096, offset))
+    finally:
+        os.close(fd)
+
+
+def write_file(path, data):
+    with open(path, "wb") as f:
+        f.write(data)
+
+
+def small_uploads(result, mnt, args):
+    data = b"s" * 4096
+    for i in range(args.small_uploads):
+        result.time(write_file, os.path.join(mnt, "upload", "small%05d" % i),
+                    data)
+        result.bytes += len(data)
+
+
+def large_upload(result, mnt, args):
+    block = os.urandom(CHUNK)
+    with open(os.path.join(mnt, "upload", "large"), "wb", buffering=0) as f:
+        for _ in range((args.large_mb << 20) // CHUNK):
+            result.bytes += result.time(f.write, block)
+        result.time(f.close)
+
+
+WORKLOADS = (
+    ("find-cold", find),
+    ("find-warm", find),
+    ("ls-l-huge", ls_huge),
+    ("seq-read", seq_read),
+    ("random-read", rand_read),
+    ("small-uploads", small_uploads),
+    ("large-upload", large_upload),
+)
+
+
+def mount(args, url, mnt):
+    cmd = [args.curlftpfs, "-f", url, mnt]
+    if args.options:
+        cmd += ["-o", args.options]
+    proc = subprocess.Popen(cmd)
+    deadline = time.time() + 10
+    while not os.path.ismount(mnt):
+        if proc.poll() is not None or time.time() > deadline:
+            proc.kill()
+            sys.exit("curlftpfs failed to mount %s" % url)
+        time.sleep(0.05)
+    return proc
+
+
+def unmount(proc, mnt):
+    subprocess.call(["fusermount", "-u", mnt])
+    try:
+        proc.wait(10)
+    except subprocess.TimeoutExpired:
+        proc.kill()
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Benchmark curlftpfs against a local FTP server")
+    parser.add_argument("--curlftpfs", default=os.path.join(
+        os.path.dirname(os.path.abspath(__file__)), "..", "curlftpfs"))
+    parser.add_argument("-o", dest="options", default="",
+                        help="mount options passed to curlftpfs")
+    parser.add_argument("--no-mount", metavar="DIR",
+                        help="run the workloads on a copy of the tree made "
+                             "in DIR, without mounting anything")
+    parser.add_argument("--dirs", type=int, default=20)
+    parser.add_argument("--files", type=int, default=50)
+    parser.add_argument("--huge", type=int, default=10000)
+    parser.add_argument("--large-mb", type=int, default=64)
+    parser.add_argument("--random-reads", type=int, default=500)
+    parser.add_argument("--small-uploads", type=int, default=200)
+    parser.add_argument("--keep", action="store_true",
+                        help="keep the served tree")
+    ftpserver.add_link_arguments(parser)
+    args = parser.parse_args()
+
+    work = tempfile.mkdtemp(prefix="curlftpfs-bench-")
+    root = os.path.join(work, "root")
+    mnt = os.path.join(work, "mnt")
+    os.makedirs(mnt)
+    ftpserver.generate_tree(root, args.dirs, args.files, args.huge,
+                            args.large_mb << 20)
+
+    server = None
+    proc = None
+    copy = None
+    try:
+        if args.no_mount:
+            copy = tempfile.mkdtemp(prefix="curlftpfs-bench-",
+                                    dir=args.no_mount)
+            mnt = os.path.join(copy, "tree")
+            shutil.copytree(root, mnt, symlinks=True)
+        else:
+            server = ftpserver.FTPServer(root, **ftpserver.link_options(args))
+            server.start()
+            proc = mount(args, "ftp://127.0.0.1:%d/" % server.port, mnt)
+            print("curlftpfs mounted ftp://127.0.0.1:%d/ on %s" %
+                  (server.port, mnt))
+        for name, workload in WORKLOADS:
+            result = Result(name)
+            if server:
+                server.reset_counts()
+            start = time.perf_counter()
+            workload(result, mnt, args)
+            result.elapsed = time.perf_counter() - start
+            if server:
+                result.commands = server.reset_counts()
+            print(result.report())
+            sys.stdout.flush()
+    finally:
+        if proc:
+            unmount(proc, mnt)
+        if server:
+            server.shutdown()
+            server.server_close()
+        if copy:
+            shutil.rmtree(copy, ignore_errors=True)
+        if args.keep:
+            print("tree kept in %s" % root)
+        else:
+            shutil.rmtree(work, ignore_errors=True)
+
+
+if __name__ == "__main__":
+    main()
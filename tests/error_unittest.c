@@ -0,0 +1,94 @@
+/*
+    FTP file system
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "error.h"
+
+#define THREADS 4
+#define LINES 200
+
+static void *log_thread(void *data) {
+  int i;
+  for (i = 0; i < LINES; i++)
+    ftpfs_debug_printf(0, __FILE__, __LINE__, "thread %ld line %d\n",
+                       (long) data, i);
+  return NULL;
+}
+
+/* Returns how many lines of the log contain needle */
+static int count(FILE *log, const char *needle) {
+  char line[1024];
+  int n = 0;
+
+  rewind(log);
+  while (fgets(line, sizeof(line), log))
+    if (strstr(line, needle))
+      n++;
+  return n;
+}
+
+int main(int argc, char **argv) {
+  pthread_t threads[THREADS];
+  FILE *log = tmpfile();
+  int level = 0;
+  long t;
+  int i;
+
+  (void) argc;
+  (void) argv;
+
+  assert(log != NULL);
+  fflush(stderr);
+  assert(dup2(fileno(log), STDERR_FILENO) == STDERR_FILENO);
+
+  /* A message that keeps coming back is only written a few times */
+  for (i = 0; i < 20; i++)
+    ftpfs_error("ftpfs: operation %s failed because %s\n", "ftpfs_getattr",
+                "No such file or directory");
+  ftpfs_error("ftpfs: operation %s failed because %s\n", "ftpfs_open",
+              "Permission denied");
+  assert(count(log, "ftpfs_getattr failed") == 5);
+  assert(count(log, "ftpfs_open failed") == 1);
+
+  /* Long messages are cut and still end their line */
+  {
+    char big[4096];
+    memset(big, 'x', sizeof(big) - 1);
+    big[sizeof(big) - 1] = '\0';
+    ftpfs_debug_printf(1, "big.c", 1, "%s\n", big);
+    assert(count(log, " big.c:1 xxx") == 1);
+  }
+
+  /* Messages from all threads go through the rings and are all written out
+     when the logger stops */
+  ftpfs_log_start(&level);
+  for (t = 0; t < THREADS; t++)
+    assert(pthread_create(&threads[t], NULL, log_thread, (void *) t) == 0);
+  for (t = 0; t < THREADS; t++)
+    assert(pthread_join(threads[t], NULL) == 0);
+  ftpfs_log_stop();
+  assert(count(log, " line ") == THREADS * LINES);
+  assert(count(log, "thread 0 line 0\n") == 1);
+
+  /* The debug level follows SIGUSR1 and SIGUSR2 */
+  raise(SIGUSR1);
+  raise(SIGUSR1);
+  assert(level == 2);
+  raise(SIGUSR2);
+  raise(SIGUSR2);
+  raise(SIGUSR2);
+  assert(level == 0);
+
+  return 0;
+}
@@ -0,0 +1,260 @@
+/*
+    FTP file system
+    Copyright (C) 2006 Robson Braga Araujo <robsonbraga@gmail.com>
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+/* Measures how fast LIST output is parsed, fed to the parser in chunks the
+   size curl hands them over, on synthetic listings in each dialect. The
+   listings mix files, directories and symlinks, recent and old dates, and
+   names in the server's codepage.
+
+   usage: ftpfs-ls_bench [corpus [lines [runs [list_threads]]]]
+
+   corpus is one of unix, dos, netware, mixed or all (the default). Without
+   a line count (or with 0), listings of 1k up to 10M lines are measured,
+   once each unless told otherwise. */
+
+#include <time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+
+#include "ftpfs.h"
+#include "ftpfs-ls.h"
+
+#define CHUNK 16384
+
+/* Distinct lines in a corpus; longer listings go through them again */
+#define CORPUS_LINES 65536
+
+struct ftpfs ftpfs;
+
+#ifdef __GLIBC__
+/* Counts the allocations made while parsing */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long allocs;
+
+void *malloc(size_t size)
+{
+  __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+  __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+  return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+  __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+  return __libc_realloc(ptr, size);
+}
+
+#define ALLOCS() __atomic_load_n(&allocs, __ATOMIC_RELAXED)
+#else
+#define ALLOCS() 0UL
+#endif
+
+static const char *months[] = {
+  "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+  "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+/* Every eighth name is in CP1251 */
+static const char *name_prefix(int i)
+{
+  return i % 8 == 7 ? "\xef\xf0\xe8\xec\xe5\xf0-" : "file-";
+}
+
+static int unix_line(char *line, size_t size, int i)
+{
+  const char *month = months[i % 12];
+  int day = i % 28 + 1;
+
+  switch (i % 4) {
+    case 0:
+      return snprintf(line, size,
+                      "-rw-r--r--    1 ftp      ftp      %9d %s %2d %02d:%02d "
+                      "%s%d.tar.gz\r\n",
+                      i * 7, month, day, i % 24, i % 60, name_prefix(i), i);
+    case 1:
+      return snprintf(line, size,
+                      "drwxr-xr-x    4 1137     1100          4096 %s %2d  %d "
+                      "dir-%d\r\n", month, day, 1995 + i % 20, i);
+    case 2:
+      return snprintf(line, size,
+                      "lrwxrwxrwx    1 ftp      ftp            %d %s %2d  %d "
+                      "link-%d -> ../target/%s%d\r\n",
+                      i % 100, month, day, 1995 + i % 20, i, name_prefix(i), i);
+    default:
+      return snprintf(line, size,
+                      "-rw-------   1 robson users %d %s %d %02d:%02d "
+                      "a file with spaces %s%d\r\n",
+                      i * 3, month, day, i % 24, i % 60, name_prefix(i), i);
+  }
+}
+
+static int dos_line(char *line, size_t size, int i)
+{
+  int hour = i % 12 + 1;
+
+  if (i % 4 == 1)
+    return snprintf(line, size,
+                    "%02d-%02d-%02d  %02d:%02d%s       <DIR>          dir-%d\r\n",
+                    i % 12 + 1, i % 28 + 1, i % 100, hour, i % 60,
+                    i % 2 ? "PM" : "AM", i);
+  return snprintf(line, size,
+                  "%02d-%02d-%02d  %02d:%02d%s             %9d %s%d.doc\r\n",
+                  i % 12 + 1, i % 28 + 1, i % 100, hour, i % 60,
+                  i % 2 ? "PM" : "AM", i * 7, name_prefix(i), i);
+}
+
+static int netware_line(char *line, size_t size, int i)
+{
+  const char *month = months[i % 12];
+  int day = i % 28 + 1;
+
+  if (i % 4 == 1)
+    return snprintf(line, size,
+                    "d [RWCEAFMS] admin                 512 %s %2d  %d "
+                    "dir-%d\r\n", month, day, 1995 + i % 20, i);
+  return snprintf(line, size,
+                  "- [RWCEAFMS] admin            %9d %s %2d %02d:%02d "
+                  "%s%d.dat\r\n",
+                  i * 7, month, day, i % 24, i % 60, name_prefix(i), i);
+}
+
+static int mixed_line(char *line, size_t size, int i)
+{
+  switch (i % 3) {
+    case 0: return unix_line(line, size, i);
+    case 1: return dos_line(line, size, i);
+    default: return netware_line(line, size, i);
+  }
+}
+
+static const struct corpus {
+  const char *name;
+  int (*line)(char *line, size_t size, int i);
+} corpora[] = {
+  { "unix",    unix_line },
+  { "dos",     dos_line },
+  { "netware", netware_line },
+  { "mixed",   mixed_line },
+};
+
+#define NUM_CORPORA (sizeof(corpora) / sizeof(corpora[0]))
+
+static unsigned long entries;
+
+static int count_filler(fuse_cache_dirh_t h, const char *name,
+                        const struct stat *sbuf)
+{
+  (void) h;
+  (void) name;
+  (void) sbuf;
+  entries++;
+  return 0;
+}
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench(const struct corpus *corpus, long nlines, int runs)
+{
+  static size_t ends[CORPUS_LINES];
+  struct buffer list;
+  long i, nlines_corpus;
+  int run;
+
+  buf_init(&list);
+  for (i = 0; i < CORPUS_LINES && i < nlines; i++) {
+    char line[256];
+    buf_add_mem(&list, line, corpus->line(line, sizeof(line), i));
+    ends[i] = list.len;
+  }
+  nlines_corpus = i;
+
+  for (run = 0; run < runs; run++) {
+    struct list_parser parser;
+    unsigned long allocs_before;
+    double start, elapsed;
+    size_t bytes = 0, off;
+    long line;
+
+    entries = 0;
+    allocs_before = ALLOCS();
+    start = now();
+    list_parser_init(&parser, "/", NULL, NULL, NULL, 0,
+                     (fuse_cache_dirh_t) &parser, count_filler);
+    for (line = 0; line < nlines; line += nlines_corpus) {
+      /* The last pass may only go through part of the corpus */
+      size_t end = nlines - line < nlines_corpus ?
+                   ends[nlines - line - 1] : list.len;
+      for (off = 0; off < end; off += CHUNK) {
+        size_t len = end - off < CHUNK ? end - off : CHUNK;
+        list_parser_feed(&parser, (const char *) list.p + off, len);
+      }
+      bytes += end;
+    }
+    list_parser_finish(&parser);
+    elapsed = now() - start;
+    assert(entries == (unsigned long) nlines);
+
+    printf("%-8s %9ld lines  lines/s=%12.0f MB/s=%8.1f allocs/line=%6.2f\n",
+           corpus->name, nlines, nlines / elapsed, bytes / elapsed / 1e6,
+           (double) (ALLOCS() - allocs_before) / nlines);
+  }
+
+  buf_free(&list);
+}
+
+int main(int argc, char **argv) {
+  const char *name = argc > 1 ? argv[1] : "all";
+  long nlines = argc > 2 ? atol(argv[2]) : 0;
+  int runs = argc > 3 ? atoi(argv[3]) : nlines > 0 ? 3 : 1;
+  int threads = argc > 4 ? atoi(argv[4]) : sysconf(_SC_NPROCESSORS_ONLN) - 1;
+  size_t c;
+  int found = 0;
+
+  ftpfs.blksize = 4096;
+  ftpfs.list_threads = threads > 0 ? threads : 0;
+  ftpfs.codepage = "CP1251";
+  ftpfs.iocharset = "UTF-8";
+
+  for (c = 0; c < NUM_CORPORA; c++) {
+    if (strcmp(name, "all") && strcmp(name, corpora[c].name))
+      continue;
+    if (!found++)
+      printf("%d listing threads, names from %s\n", ftpfs.list_threads,
+             ftpfs.codepage);
+    if (nlines > 0) {
+      bench(&corpora[c], nlines, runs);
+    } else {
+      long n;
+      for (n = 1000; n <= 10000000; n *= 10)
+        bench(&corpora[c], n, runs);
+    }
+  }
+
+  if (!found) {
+    fprintf(stderr, "usage: %s [unix|dos|netware|mixed|all "
+                    "[lines [runs [list_threads]]]]\n", argv[0]);
+    return 1;
+  }
+  return 0;
+}
@@ -15,9 +15,29 @@
 
 #include "ftpfs.h"
 #include "ftpfs-ls.h"
+#include "charset_utils.h"
 
 struct ftpfs ftpfs;
 
+#define BIG_LISTING 40000
+
+static struct {
+  char name[32];
+  off_t size;
+} listed[2][BIG_LISTING];
+static int nlisted;
+
+static int collect_filler(fuse_cache_dirh_t h, const char *name,
+                          const struct stat *sbuf)
+{
+  int which = h != NULL && *(int *) h;
+  assert(nlisted < BIG_LISTING);
+  snprintf(listed[which][nlisted].name, 32, "%s", name);
+  listed[which][nlisted].size = sbuf->st_size;
+  nlisted++;
+  return 0;
+}
+
 #define check_numeric_is(got, expected, fmt, cast) \
   do { \
     if ((got) != (expected)) { \
@@ -54,7 +74,7 @@ int main(int argc, char **argv) {
   char line[256];
   struct fuse_cache_operations dummy_oper;
   struct stat sbuf;
-  int err;
+  int err, chunk;
   struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
   char linkbuf[1024];
   char date[20];
@@ -152,6 +172,95 @@ int main(int argc, char **argv) {
   assert(err == 0);
   check(sbuf, 0, 0, S_IFREG|S_IRUSR|S_IWUSR, 1, 0, 0, 0, 6561177600LL, 4096, 12814800, "00:00:00 15/10/2005");
 
+  list = "d [RWCEAFMS] admin                 512 Jan 29  2004 Login\r\n";
+  err = parse_dir(list, "/", "Login", &sbuf, NULL, 0, NULL, NULL);
+  assert(err == 0);
+  check(sbuf, 0, 0, S_IFDIR|S_IRUSR|S_IWUSR|S_IXUSR|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH, 1, 0, 0, 0, 512, 4096, 8, "00:00:00 29/01/2004");
+
+  list = "- [R----F--] admin               17920 Dec 11  2003 a file.doc\r\n";
+  err = parse_dir(list, "/", "a file.doc", &sbuf, NULL, 0, NULL, NULL);
+  assert(err == 0);
+  check(sbuf, 0, 0, S_IFREG|S_IRUSR|S_IRGRP|S_IROTH, 1, 0, 0, 0, 17920, 4096, 40, "00:00:00 11/12/2003");
+
+  /* Names are converted from the server's codepage, ASCII ones as they are */
+  ftpfs.codepage = "CP1251";
+  ftpfs.iocharset = "UTF-8";
+  list = "-rw-r--r--  1 robson users   12 Jan 01  2001 \xcf\xf0\xe8\r\n";
+  err = parse_dir(list, "/", "\xd0\x9f\xd1\x80\xd0\xb8", &sbuf, NULL, 0, NULL, NULL);
+  assert(err == 0);
+  list = "-rw-r--r--  1 robson users   12 Jan 01  2001 plain\r\n";
+  err = parse_dir(list, "/", "plain", &sbuf, NULL, 0, NULL, NULL);
+  assert(err == 0);
+  assert(charset_passthrough(ftpfs.iocharset, ftpfs.codepage, "plain"));
+  assert(!charset_passthrough(ftpfs.iocharset, ftpfs.codepage, "\xd0\x9f"));
+  ftpfs.codepage = NULL;
+  ftpfs.iocharset = NULL;
+
+  /* A forced dialect doesn't fall back to the others */
+  ftpfs.list_dialect = LIST_DIALECT_DOS;
+  list = "dr-xr-xr-x   2 root     512 Apr  8  1994 etc\r\n";
+  err = parse_dir(list, "/", "etc", &sbuf, NULL, 0, NULL, NULL);
+  assert(err == 1);
+  list = "05-14-03  02:49PM                40448 PR_AU13_CH.doc\r\n";
+  err = parse_dir(list, "/", "PR_AU13_CH.doc", &sbuf, NULL, 0, NULL, NULL);
+  assert(err == 0);
+  ftpfs.list_dialect = LIST_DIALECT_AUTO;
+
+  /* Lines split across several chunks, the way they come off the wire */
+  list = "-rw-r--r--  1 robson users   12 Jan 01  2001 a\r\n"
+         "lrwxrwxrwx   1 1             17 Nov 24  2002 lg -> cidirb/documentos\r\n"
+         "-rw-r--r--  1 robson users   1803128 Jan 01  2001 last\r\n";
+  for (chunk = 1; chunk <= (int) strlen(list); chunk++) {
+    struct list_parser parser;
+    size_t off;
+    list_parser_init(&parser, "/", "last", &sbuf, NULL, 0, NULL, NULL);
+    for (off = 0; off < strlen(list); off += chunk) {
+      size_t len = strlen(list) - off;
+      list_parser_feed(&parser, list + off, len < (size_t) chunk ? len : (size_t) chunk);
+    }
+    err = list_parser_finish(&parser);
+    assert(err == 0);
+    check(sbuf, 0, 0, S_IFREG|S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH, 1, 0, 0, 0, 1803128, 4096, 3528, "00:00:00 01/01/2001");
+
+    list_parser_init(&parser, "/", "lg", NULL, linkbuf, 1024, NULL, NULL);
+    for (off = 0; off < strlen(list); off += chunk) {
+      size_t len = strlen(list) - off;
+      list_parser_feed(&parser, list + off, len < (size_t) chunk ? len : (size_t) chunk);
+    }
+    err = list_parser_finish(&parser);
+    assert(err == 0);
+    assert(!strcmp(linkbuf, "cidirb/documentos"));
+  }
+
+  /* Big listings are parsed in parallel, but come out the same and in the
+     same order */
+  {
+    struct buffer big;
+    int run, i;
+    buf_init(&big);
+    for (i = 0; i < BIG_LISTING; i++) {
+      snprintf(line, sizeof(line), i % 3 ?
+               "-rw-r--r--    1 ftp      ftp      %9d Mar 12  2001 file-%d\r\n" :
+               "05-14-03  02:49PM             %9d file-%d\r\n", i * 7, i);
+      buf_add_mem(&big, line, strlen(line));
+    }
+    buf_null_terminate(&big);
+    for (run = 0; run < 2; run++) {
+      ftpfs.list_threads = run ? 3 : 0;
+      nlisted = 0;
+      parse_dir((char *) big.p, "/", NULL, NULL, NULL, 0,
+                (fuse_cache_dirh_t) &run, collect_filler);
+      assert(nlisted == BIG_LISTING);
+    }
+    ftpfs.list_threads = 0;
+    for (i = 0; i < BIG_LISTING; i++) {
+      assert(!strcmp(listed[0][i].name, listed[1][i].name));
+      assert(listed[0][i].size == listed[1][i].size);
+      assert(listed[1][i].size == i * 7);
+    }
+    buf_free(&big);
+  }
+
   fuse_opt_free_args(&args);
 
   cache_deinit();
@@ -0,0 +1,506 @@
+#!/usr/bin/env python3
+#
+#   FTP file system
+#
+#   This program can be distributed under the terms of the GNU GPL.
+#   See the file COPYING.
+#
+# A minimal FTP server serving a local directory, good enough to mount
+# curlftpfs against on loopback. It speaks the part of RFC 959 that libcurl
+# and curlftpfs use, with passive data connections only. Any user name and
+# password are accepted.
+#
+# Links slower than loopback can be emulated: every command and every new
+# data connection can be delayed by a round trip, data connections can be
+# throttled, and connections can be dropped at random.
+#
+# usage: ftpserver.py [--port N] [--generate] [--rtt-ms MS] [--jitter-ms MS]
+#                     [--bandwidth KB/s] [--drop-rate P] [--seed N] root
+
+import argparse
+import os
+import random
+import socket
+import socketserver
+import stat
+import sys
+import threading
+import time
+
+MONTHS = ("Jan", "Feb", "Mar", "Apr", "May", "Jun",
+          "Jul", "Aug", "Sep", "Oct", "Nov", "Dec")
+
+DATA_BLOCK = 65536
+
+
+class Dropped(Exception):
+    """The emulated link dropped the connection."""
+
+
+def list_line(name, st):
+    """Formats one entry the way ls -l does."""
+    mode = st.st_mode
+    kind = "d" if stat.S_ISDIR(mode) else "l" if stat.S_ISLNK(mode) else "-"
+    perms = ""
+    for who in ("USR", "GRP", "OTH"):
+        for what, char in (("R", "r"), ("W", "w"), ("X", "x")):
+            perms += char if mode & getattr(stat, "S_I" + what + who) else "-"
+    tm = time.gmtime(st.st_mtime)
+    if abs(time.time() - st.st_mtime) < 180 * 86400:
+        when = "%s %2d %02d:%02d" % (MONTHS[tm.tm_mon - 1], tm.tm_mday,
+                                     tm.tm_hour, tm.tm_min)
+    else:
+        when = "%s %2d  %d" % (MONTHS[tm.tm_mon - 1], tm.tm_mday, tm.tm_year)
+    return "%s%s %4d ftp      ftp      %10d %s %s" % (
+        kind, perms, st.st_nlink, st.st_size, when, name)
+
+
+class FTPHandler(socketserver.StreamRequestHandler):
+    """One control connection."""
+
+    def setup(self):
+        super().setup()
+        self.cwd = "/"
+        self.pasv = None
+        self.rest = 0
+        self.rnfr = None
+        self.type = "A"
+
+    # Replies and data connections
+
+    def reply(self, line):
+        self.wfile.write((line + "\r\n").encode("utf-8", "surrogateescape"))
+        self.wfile.flush()
+
+    def open_passive(self):
+        if self.pasv is not None:
+            self.pasv.close()
+        self.pasv = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.pasv.bind((self.server.server_address[0], 0))
+        self.pasv.listen(1)
+        self.pasv.settimeout(30)
+        return self.pasv.getsockname()[1]
+
+    def drop(self):
+        if self.server.should_drop():
+            self.server.count("DROP")
+            raise Dropped()
+
+    def accept_data(self):
+        if self.pasv is None:
+            self.reply("425 Use PASV or EPSV first")
+            return None
+        try:
+            conn, _ = self.pasv.accept()
+            # The TCP handshake of the data connection is one more trip
+            self.server.round_trip()
+        except OSError:
+            self.reply("425 Can't open data connection")
+            return None
+        finally:
+            self.pasv.close()
+            self.pasv = None
+        self.reply("150 Opening data connection")
+        return conn
+
+    def send_data(self, conn, data):
+        view = memoryview(data)
+        slice_size = self.server.slice_size()
+        start = time.monotonic()
+        for off in range(0, len(view), slice_size):
+            self.drop()
+            conn.sendall(view[off:off + slice_size])
+            self.server.throttle(start, off + slice_size)
+
+    def recv_data(self, conn, start, received):
+        self.drop()
+        self.server.throttle(start, received)
+        return conn.recv(min(DATA_BLOCK, self.server.slice_size()))
+
+    # Paths
+
+    def virtual(self, arg):
+        path = arg if arg.startswith("/") else self.cwd.rstrip("/") + "/" + arg
+        parts = []
+        for part in path.split("/"):
+            if part in ("", "."):
+                continue
+            if part == "..":
+                if parts:
+                    parts.pop()
+            else:
+                parts.append(part)
+        return "/" + "/".join(parts)
+
+    def real(self, arg):
+        return os.path.join(self.server.root,
+                            self.virtual(arg).lstrip("/"))
+
+    # Command loop
+
+    def handle(self):
+        self.reply("220 curlftpfs test server ready")
+        while True:
+            try:
+                line = self.rfile.readline()
+            except OSError:
+                break
+            if not line:
+                break
+            line = line.decode("utf-8", "surrogateescape").rstrip("\r\n")
+            cmd, _, arg = line.partition(" ")
+            cmd = cmd.upper()
+            self.server.count(cmd)
+            method = getattr(self, "ftp_" + cmd, None)
+            try:
+                self.server.round_trip()
+                self.drop()
+                if method is None:
+                    self.reply("502 Command not implemented")
+                elif method(arg) is False:
+                    break
+            except (BrokenPipeError, ConnectionResetError, Dropped):
+                break
+            except OSError as e:
+                self.reply("550 %s" % e.strerror)
+        if self.pasv is not None:
+            self.pasv.close()
+
+    # Session
+
+    def ftp_USER(self, arg):
+        self.reply("331 Password required")
+
+    def ftp_PASS(self, arg):
+        self.reply("230 Logged in")
+
+    def ftp_SYST(self, arg):
+        self.reply("215 UNIX Type: L8")
+
+    def ftp_FEAT(self, arg):
+        self.reply("211-Features:")
+        for feature in ("EPSV", "PASV", "REST STREAM", "SIZE", "MDTM", "UTF8"):
+            self.reply(" " + feature)
+        self.reply("211 End")
+
+    def ftp_OPTS(self, arg):
+        self.reply("200 OK")
+
+    def ftp_NOOP(self, arg):
+        self.reply("200 OK")
+
+    def ftp_TYPE(self, arg):
+        self.type = arg.upper()[:1] or "A"
+        self.reply("200 Type set to " + self.type)
+
+    def ftp_MODE(self, arg):
+        self.reply("200 OK")
+
+    def ftp_STRU(self, arg):
+        self.reply("200 OK")
+
+    def ftp_QUIT(self, arg):
+        self.reply("221 Bye")
+        return False
+
+    def ftp_ABOR(self, arg):
+        self.reply("226 Abort successful")
+
+    # Navigation
+
+    def ftp_PWD(self, arg):
+        self.reply('257 "%s" is the current directory' % self.cwd)
+
+    def ftp_CWD(self, arg):
+        if os.path.isdir(self.real(arg)):
+            self.cwd = self.virtual(arg)
+            self.reply("250 OK")
+        else:
+            self.reply("550 No such directory")
+
+    def ftp_CDUP(self, arg):
+        self.ftp_CWD("..")
+
+    # Data connections
+
+    def ftp_PASV(self, arg):
+        host = self.server.server_address[0].replace(".", ",")
+        port = self.open_passive()
+        self.reply("227 Entering Passive Mode (%s,%d,%d)" %
+                   (host, port >> 8, port & 0xff))
+
+    def ftp_EPSV(self, arg):
+        self.reply("229 Entering Extended Passive Mode (|||%d|)" %
+                   self.open_passive())
+
+    def ftp_REST(self, arg):
+        self.rest = int(arg)
+        self.reply("350 Restarting at %d" % self.rest)
+
+    def ftp_LIST(self, arg):
+        args = [a for a in arg.split() if not a.startswith("-")]
+        path = self.real(args[0] if args else ".")
+        if os.path.isdir(path):
+            names = sorted(os.listdir(path))
+        else:
+            names = [os.path.basename(path)]
+            path = os.path.dirname(path)
+        lines = []
+        for name in names:
+            try:
+                st = os.lstat(os.path.join(path, name))
+            except OSError:
+                continue
+            entry = list_line(name, st)
+            if stat.S_ISLNK(st.st_mode):
+                entry += " -> " + os.readlink(os.path.join(path, name))
+            lines.append(entry + "\r\n")
+        conn = self.accept_data()
+        if conn is None:
+            return
+        with conn:
+            self.send_data(conn, "".join(lines).encode("utf-8",
+                                                       "surrogateescape"))
+        self.reply("226 Transfer complete")
+
+    def ftp_NLST(self, arg):
+        path = self.real(arg or ".")
+        names = sorted(os.listdir(path))
+        conn = self.accept_data()
+        if conn is None:
+            return
+        with conn:
+            self.send_data(conn, "".join(n + "\r\n" for n in names)
+                           .encode("utf-8", "surrogateescape"))
+        self.reply("226 Transfer complete")
+
+    def ftp_RETR(self, arg):
+        rest, self.rest = self.rest, 0
+        with open(self.real(arg), "rb") as f:
+            f.seek(rest)
+            conn = self.accept_data()
+            if conn is None:
+                return
+            with conn:
+                try:
+                    while True:
+                        block = f.read(DATA_BLOCK)
+                        if not block:
+                            break
+                        self.send_data(conn, block)
+                except (BrokenPipeError, ConnectionResetError):
+                    # Clients reading a range close the connection early
+                    self.reply("426 Transfer aborted")
+                    return
+        self.reply("226 Transfer complete")
+
+    def store(self, arg, mode):
+        rest, self.rest = self.rest, 0
+        path = self.real(arg)
+        with open(path, mode) as f:
+            if rest:
+                f.seek(rest)
+            conn = self.accept_data()
+            if conn is None:
+                return
+            with conn:
+                start = time.monotonic()
+                received = 0
+                while True:
+                    block = self.recv_data(conn, start, received)
+                    if not block:
+                        break
+                    f.write(block)
+                    received += len(block)
+        self.reply("226 Transfer complete")
+
+    def ftp_STOR(self, arg):
+        self.store(arg, "r+b" if self.rest else "wb")
+
+    def ftp_APPE(self, arg):
+        self.store(arg, "ab")
+
+    # File management
+
+    def ftp_SIZE(self, arg):
+        path = self.real(arg)
+        if os.path.isfile(path):
+            self.reply("213 %d" % os.path.getsize(path))
+        else:
+            self.reply("550 Not a regular file")
+
+    def ftp_MDTM(self, arg):
+        st = os.stat(self.real(arg))
+        self.reply("213 " + time.strftime("%Y%m%d%H%M%S",
+                                          time.gmtime(st.st_mtime)))
+
+    def ftp_DELE(self, arg):
+        os.unlink(self.real(arg))
+        self.reply("250 Deleted")
+
+    def ftp_MKD(self, arg):
+        os.mkdir(self.real(arg))
+        self.reply('257 "%s" created' % self.virtual(arg))
+
+    def ftp_RMD(self, arg):
+        os.rmdir(self.real(arg))
+        self.reply("250 Removed")
+
+    def ftp_RNFR(self, arg):
+        self.rnfr = self.real(arg)
+        os.lstat(self.rnfr)
+        self.reply("350 Ready for RNTO")
+
+    def ftp_RNTO(self, arg):
+        if self.rnfr is None:
+            self.reply("503 RNFR first")
+            return
+        os.rename(self.rnfr, self.real(arg))
+        self.rnfr = None
+        self.reply("250 Renamed")
+
+    def ftp_SITE(self, arg):
+        what, _, rest = arg.partition(" ")
+        if what.upper() == "CHMOD":
+            mode, _, name = rest.partition(" ")
+            os.chmod(self.real(name), int(mode, 8))
+            self.reply("200 Mode changed")
+        else:
+            self.reply("502 SITE %s not implemented" % what)
+
+
+class FTPServer(socketserver.ThreadingTCPServer):
+    """Serves root on host:port, a port of 0 picking a free one."""
+
+    daemon_threads = True
+    allow_reuse_address = True
+
+    def __init__(self, root, host="127.0.0.1", port=0, rtt=0.0, jitter=0.0,
+                 bandwidth=0, drop_rate=0.0, seed=None):
+        super().__init__((host, port), FTPHandler)
+        self.root = os.path.abspath(root)
+        self.commands = {}
+        self.commands_lock = threading.Lock()
+        self.rtt = rtt
+        self.jitter = jitter
+        self.bandwidth = bandwidth
+        self.drop_rate = drop_rate
+        self.random = random.Random(seed)
+        self.random_lock = threading.Lock()
+
+    @property
+    def port(self):
+        return self.server_address[1]
+
+    def count(self, cmd):
+        with self.commands_lock:
+            self.commands[cmd] = self.commands.get(cmd, 0) + 1
+
+    def round_trip(self):
+        """Waits as long as a command and its reply take on the link."""
+        if self.rtt or self.jitter:
+            with self.random_lock:
+                jitter = self.random.uniform(0, self.jitter)
+            time.sleep(self.rtt + jitter)
+
+    def should_drop(self):
+        if not self.drop_rate:
+            return False
+        with self.random_lock:
+            return self.random.random() < self.drop_rate
+
+    def slice_size(self):
+        """How much data to move at once, about 50 ms worth when throttled."""
+        if not self.bandwidth:
+            return DATA_BLOCK
+        return max(1024, min(DATA_BLOCK, self.bandwidth // 20))
+
+    def throttle(self, start, done):
+        """Sleeps until done bytes since start fit in the bandwidth."""
+        if self.bandwidth:
+            delay = start + done / self.bandwidth - time.monotonic()
+            if delay > 0:
+                time.sleep(delay)
+
+    def reset_counts(self):
+        with self.commands_lock:
+            counts, self.commands = self.commands, {}
+        return counts
+
+    def start(self):
+        thread = threading.Thread(target=self.serve_forever, daemon=True)
+        thread.start()
+        return thread
+
+
+def generate_tree(root, dirs=20, files=50, huge=10000, large=64 << 20):
+    """Fills root with a tree to benchmark against.
+
+    tree/ has dirs directories of files small files each, and a symlink in
+    each; huge/ has huge empty files; large is a file of large bytes."""
+    tree = os.path.join(root, "tree")
+    for d in range(dirs):
+        path = os.path.join(tree, "dir%03d" % d)
+        os.makedirs(path, exist_ok=True)
+        for f in range(files):
+            with open(os.path.join(path, "file%04d.txt" % f), "wb") as out:
+                out.write(b"x" * (100 + f * 37))
+        link = os.path.join(path, "link")
+        if not os.path.lexists(link):
+            os.symlink("file0000.txt", link)
+    path = os.path.join(root, "huge")
+    os.makedirs(path, exist_ok=True)
+    for f in range(huge):
+        open(os.path.join(path, "entry%06d" % f), "wb").close()
+    with open(os.path.join(root, "large"), "wb") as out:
+        block = os.urandom(1 << 20)
+        for _ in range(large >> 20):
+            out.write(block)
+        out.write(block[:large & ((1 << 20) - 1)])
+    os.makedirs(os.path.join(root, "upload"), exist_ok=True)
+
+
+def add_link_arguments(parser):
+    """Adds the options emulating a slower link to parser."""
+    parser.add_argument("--rtt-ms", type=float, default=0,
+                        help="round trip time added to every command")
+    parser.add_argument("--jitter-ms", type=float, default=0,
+                        help="random extra delay of up to this much")
+    parser.add_argument("--bandwidth", type=int, default=0, metavar="KB/s",
+                        help="limit of each data connection")
+    parser.add_argument("--drop-rate", type=float, default=0, metavar="P",
+                        help="chance of dropping the connection on each "
+                             "command or block of data")
+    parser.add_argument("--seed", type=int, default=None,
+                        help="seed of the jitter and drops")
+
+
+def link_options(args):
+    return {"rtt": args.rtt_ms / 1e3, "jitter": args.jitter_ms / 1e3,
+            "bandwidth": args.bandwidth * 1024, "drop_rate": args.drop_rate,
+            "seed": args.seed}
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Minimal FTP server for benchmarks")
+    parser.add_argument("root", help="directory to serve")
+    parser.add_argument("--port", type=int, default=2121)
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--generate", action="store_true",
+                        help="fill root with a benchmark tree first")
+    add_link_arguments(parser)
+    args = parser.parse_args()
+
+    if args.generate:
+        generate_tree(args.root)
+    server = FTPServer(args.root, args.host, args.port, **link_options(args))
+    print("serving %s on ftp://%s:%d/" % (server.root, args.host, server.port))
+    sys.stdout.flush()
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,73 @@
+/*
+    FTP file system
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <glib.h>
+
+#include "stats.h"
+
+static void *record_thread(void *data) {
+  int i;
+  (void) data;
+  for (i = 0; i < 10; i++)
+    stats_record(STATS_OP_READ, 3000);
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  pthread_t thread;
+  char *text;
+  int i;
+
+  (void) argc;
+  (void) argv;
+
+  stats_add(STATS_LIST, 1);
+  stats_add(STATS_LIST, 2);
+  stats_add(STATS_BYTES_DOWN, 1 << 20);
+  assert(stats_get(STATS_LIST) == 3);
+  assert(stats_get(STATS_RETR) == 0);
+
+  /* Gauges go down as well as up */
+  stats_add(STATS_UPLOADS, 1);
+  stats_add(STATS_UPLOADS, 1);
+  stats_add(STATS_UPLOADS, -1);
+  assert(stats_get(STATS_UPLOADS) == 1);
+
+  /* One "name value" line per counter, the cache's included */
+  text = stats_format();
+  assert(strstr(text, "cache_hits 0\n") != NULL);
+  assert(strstr(text, "list_transfers 3\n") != NULL);
+  assert(strstr(text, "bytes_downloaded 1048576\n") != NULL);
+  assert(strstr(text, "uploads_in_flight 1\n") != NULL);
+  assert(text[strlen(text) - 1] == '\n');
+  g_free(text);
+
+  /* Latencies from every thread, exited ones included, add up */
+  for (i = 0; i < 98; i++)
+    stats_record(STATS_OP_GETATTR, 100);
+  stats_record(STATS_OP_GETATTR, 0);
+  stats_record(STATS_OP_GETATTR, 5000);
+  assert(pthread_create(&thread, NULL, record_thread, NULL) == 0);
+  assert(pthread_join(thread, NULL) == 0);
+  stats_record(STATS_OP_READ, 1);
+
+  text = stats_format_latency();
+  assert(strstr(text, "op_getattr count=100 sum_us=14800 p50_us=128 "
+                      "p90_us=128 p99_us=128 buckets=1,0,0,0,0,0,0,98,"
+                      "0,0,0,0,0,1\n") != NULL);
+  assert(strstr(text, "op_read count=11 sum_us=30001 ") != NULL);
+  /* Nothing is shown for what never happened */
+  assert(strstr(text, "op_rename") == NULL);
+  g_free(text);
+
+  return 0;
+}